@@ -245,16 +245,27 @@ lval* lval_read_num(mpc_ast_t* t) {
     lval_num(x) : lval_err("invalid number");
 }
 
+/* ids of the tags lval_read looks for, set once the grammar is built */
+int TagNumber;
+int TagSymbol;
+int TagSexpr;
+int TagRegex;
+
+/* t carries only the one tag id */
+int tag_is(mpc_ast_t* t, int id) {
+  return t->tags_num == 1 && t->tags[0] == id;
+}
+
 lval* lval_read(mpc_ast_t* t) {
   
   /* If Symbol or Number return conversion to that type */
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  if (mpc_ast_has_tag(t, TagNumber)) { return lval_read_num(t); }
+  if (mpc_ast_has_tag(t, TagSymbol)) { return lval_sym(t->contents); }
   
   /* If root (>) or sexpr then create empty list */
   lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); } 
-  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
+  if (tag_is(t, MPC_TAG_ROOT)) { x = lval_sexpr(); } 
+  if (mpc_ast_has_tag(t, TagSexpr))  { x = lval_sexpr(); }
   
   printf("x = %d\n", x->type);
   /* Fill this list with any valid expression contained within */
@@ -263,7 +274,7 @@ lval* lval_read(mpc_ast_t* t) {
     if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
     if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
     if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
+    if (tag_is(t->children[i], TagRegex)) { continue; }
     x = lval_add(x, lval_read(t->children[i]));
   }
   
@@ -288,6 +299,11 @@ int main(int argc, char** argv) {
     ",
     Number, Symbol, Sexpr, Expr, Lispy);
   
+  TagNumber = mpc_tag_id("number");
+  TagSymbol = mpc_tag_id("symbol");
+  TagSexpr  = mpc_tag_id("sexpr");
+  TagRegex  = mpc_tag_id("regex");
+  
   puts("Lispy Version 0.0.0.0.5");
   puts("Press Ctrl+c to Exit\n");
   
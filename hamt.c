@@ -0,0 +1,502 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Hash array mapped trie, see hamt.h
+ *
+ * A node holds a bitmap of which of its 32 slots are occupied and a
+ * packed array with one entry per set bit. An entry is either a key and
+ * value, or (when its key is NULL) a child node one level down. Once the
+ * hash is used up, remaining keys go into an unordered collision node.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hamt.h"
+
+#define HAMT_BITS   5
+#define HAMT_MASK   ((1 << HAMT_BITS) - 1)
+
+/* past this shift the hash has no bits left and keys collide */
+#define HAMT_MAX_SHIFT  30
+
+typedef struct {
+    void *key;
+    void *val;
+} hamt_entry;
+
+typedef struct hamt_node {
+    int refs;
+    int count;
+    int collision;
+    unsigned edit;
+    uint32_t bitmap;
+    hamt_entry entries[];
+} hamt_node;
+
+/* nodes created by the current bulk build may be updated in place */
+static unsigned hamt_edit = 0;
+
+static int popcount(uint32_t x) {
+#ifdef __GNUC__
+    return __builtin_popcount(x);
+#else
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    return (int)((((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+#endif
+}
+
+/*
+ * Nodes
+ */
+
+static hamt_node *node_new(int count, unsigned edit) {
+    hamt_node *n = malloc(sizeof(hamt_node) + sizeof(hamt_entry) * count);
+    n->refs = 1;
+    n->count = count;
+    n->collision = 0;
+    n->edit = edit;
+    n->bitmap = 0;
+    return n;
+}
+
+/* drop a reference to n, passing each entry it frees to f */
+static void node_release_each(hamt_node *n, hamt_each_t f, void *d) {
+    if (n == NULL || --n->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < n->count; ++i) {
+        if (n->entries[i].key) {
+            f(n->entries[i].key, n->entries[i].val, d);
+        } else {
+            node_release_each(n->entries[i].val, f, d);
+        }
+    }
+    free(n);
+}
+
+static void entry_release(void *key, void *val, void *d) {
+    hamt_t *t = d;
+    t->release(key);
+    t->release(val);
+}
+
+static void node_release(hamt_t *t, hamt_node *n) {
+    node_release_each(n, entry_release, t);
+}
+
+static void entry_retain(hamt_t *t, hamt_entry *e) {
+    if (e->key) {
+        t->retain(e->key);
+        t->retain(e->val);
+    } else {
+        ((hamt_node*)e->val)->refs++;
+    }
+}
+
+/*
+ * Copy n, leaving a gap of `grow` (1 or 0) entries at index i, or
+ * removing entry i when grow is -1. The entries are retained, except the
+ * one being removed.
+ */
+static hamt_node *node_copy(hamt_t *t, hamt_node *n, int i, int grow, unsigned edit) {
+    hamt_node *c = node_new(n->count + grow, edit);
+    c->collision = n->collision;
+    c->bitmap = n->bitmap;
+    for (int j = 0, k = 0; j < n->count; ++j, ++k) {
+        if (j == i && grow == 1) {
+            k++;
+        }
+        if (j == i && grow == -1) {
+            k--;
+            continue;
+        }
+        c->entries[k] = n->entries[j];
+        entry_retain(t, &c->entries[k]);
+    }
+    return c;
+}
+
+static hamt_t *hamt_wrap(hamt_t *t, hamt_node *root, size_t count) {
+    hamt_t *r = malloc(sizeof(hamt_t));
+    r->count = count;
+    r->root = root;
+    r->hash = t->hash;
+    r->eq = t->eq;
+    r->retain = t->retain;
+    r->release = t->release;
+    return r;
+}
+
+/*
+ * Construction
+ */
+
+hamt_t *hamt_new(hamt_hash_t hash, hamt_eq_t eq,
+                 hamt_retain_t retain, hamt_release_t release) {
+    hamt_t *t = malloc(sizeof(hamt_t));
+    t->count = 0;
+    t->root = NULL;
+    t->hash = hash;
+    t->eq = eq;
+    t->retain = retain;
+    t->release = release;
+    return t;
+}
+
+hamt_t *hamt_copy(hamt_t *t) {
+    if (t->root) {
+        t->root->refs++;
+    }
+    return hamt_wrap(t, t->root, t->count);
+}
+
+void hamt_delete(hamt_t *t) {
+    node_release(t, t->root);
+    free(t);
+}
+
+void hamt_delete_each(hamt_t *t, hamt_each_t f, void *d) {
+    node_release_each(t->root, f, d);
+    free(t);
+}
+
+/*
+ * Lookup
+ */
+
+size_t hamt_count(hamt_t *t) {
+    return t->count;
+}
+
+void *hamt_get(hamt_t *t, void *key) {
+    hamt_node *n = t->root;
+    uint32_t hash = t->hash(key);
+    int shift = 0;
+
+    while (n) {
+        if (n->collision) {
+            for (int i = 0; i < n->count; ++i) {
+                if (t->eq(n->entries[i].key, key)) {
+                    return n->entries[i].val;
+                }
+            }
+            return NULL;
+        }
+
+        uint32_t bit = (uint32_t)1 << ((hash >> shift) & HAMT_MASK);
+        if (!(n->bitmap & bit)) {
+            return NULL;
+        }
+
+        hamt_entry *e = &n->entries[popcount(n->bitmap & (bit - 1))];
+        if (e->key) {
+            return t->eq(e->key, key) ? e->val : NULL;
+        }
+        n = e->val;
+        shift += HAMT_BITS;
+    }
+    return NULL;
+}
+
+static void node_foreach(hamt_node *n, hamt_each_t f, void *d) {
+    for (int i = 0; i < n->count; ++i) {
+        if (n->entries[i].key) {
+            f(n->entries[i].key, n->entries[i].val, d);
+        } else {
+            node_foreach(n->entries[i].val, f, d);
+        }
+    }
+}
+
+void hamt_foreach(hamt_t *t, hamt_each_t f, void *d) {
+    if (t->root) {
+        node_foreach(t->root, f, d);
+    }
+}
+
+void hamt_iter_init(hamt_iter *it, hamt_t *t) {
+    it->depth = t->root ? 1 : 0;
+    it->nodes[0] = t->root;
+    it->next[0] = 0;
+}
+
+int hamt_iter_next(hamt_iter *it, void **key, void **val) {
+    while (it->depth) {
+        hamt_node *n = it->nodes[it->depth - 1];
+        int i = it->next[it->depth - 1]++;
+        if (i == n->count) {
+            it->depth--;
+        } else if (n->entries[i].key) {
+            *key = n->entries[i].key;
+            *val = n->entries[i].val;
+            return 1;
+        } else {
+            it->nodes[it->depth] = n->entries[i].val;
+            it->next[it->depth++] = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Insertion
+ */
+
+/* a subtree holding two distinct keys that agree below `shift` */
+static hamt_node *node_pair(void *k1, void *v1, uint32_t h1,
+                            void *k2, void *v2, uint32_t h2,
+                            int shift, unsigned edit) {
+    hamt_node *n;
+
+    if (shift > HAMT_MAX_SHIFT) {
+        n = node_new(2, edit);
+        n->collision = 1;
+        n->entries[0].key = k1;
+        n->entries[0].val = v1;
+        n->entries[1].key = k2;
+        n->entries[1].val = v2;
+        return n;
+    }
+
+    uint32_t i1 = (h1 >> shift) & HAMT_MASK;
+    uint32_t i2 = (h2 >> shift) & HAMT_MASK;
+
+    if (i1 == i2) {
+        n = node_new(1, edit);
+        n->bitmap = (uint32_t)1 << i1;
+        n->entries[0].key = NULL;
+        n->entries[0].val = node_pair(k1, v1, h1, k2, v2, h2, shift + HAMT_BITS, edit);
+        return n;
+    }
+
+    n = node_new(2, edit);
+    n->bitmap = ((uint32_t)1 << i1) | ((uint32_t)1 << i2);
+    n->entries[i1 < i2 ? 0 : 1].key = k1;
+    n->entries[i1 < i2 ? 0 : 1].val = v1;
+    n->entries[i1 < i2 ? 1 : 0].key = k2;
+    n->entries[i1 < i2 ? 1 : 0].val = v2;
+    return n;
+}
+
+/*
+ * Make n writable for this update: nodes belonging to the current bulk
+ * build are resized in place, anything else is copied.
+ */
+static hamt_node *node_edit(hamt_t *t, hamt_node *n, int i, int grow, unsigned edit) {
+    if (edit == 0 || n->edit != edit) {
+        return node_copy(t, n, i, grow, edit);
+    }
+    if (grow == 1) {
+        n = realloc(n, sizeof(hamt_node) + sizeof(hamt_entry) * (n->count + 1));
+        memmove(&n->entries[i + 1], &n->entries[i], sizeof(hamt_entry) * (n->count - i));
+        n->count++;
+    }
+    return n;
+}
+
+static hamt_node *node_assoc(hamt_t *t, hamt_node *n, int shift, uint32_t hash,
+                             void *key, void *val, int *added, unsigned edit) {
+    hamt_node *c;
+
+    if (n->collision) {
+        for (int i = 0; i < n->count; ++i) {
+            if (t->eq(n->entries[i].key, key)) {
+                c = node_edit(t, n, i, 0, edit);
+                t->release(c->entries[i].val);
+                t->release(key);
+                c->entries[i].val = val;
+                return c;
+            }
+        }
+        int last = n->count;
+        c = node_edit(t, n, last, 1, edit);
+        c->entries[last].key = key;
+        c->entries[last].val = val;
+        *added = 1;
+        return c;
+    }
+
+    uint32_t bit = (uint32_t)1 << ((hash >> shift) & HAMT_MASK);
+    int i = popcount(n->bitmap & (bit - 1));
+
+    if (!(n->bitmap & bit)) {
+        c = node_edit(t, n, i, 1, edit);
+        c->bitmap |= bit;
+        c->entries[i].key = key;
+        c->entries[i].val = val;
+        *added = 1;
+        return c;
+    }
+
+    hamt_entry e = n->entries[i];
+
+    if (e.key == NULL) {
+        int owned = edit != 0 && ((hamt_node*)e.val)->edit == edit;
+        hamt_node *child = node_assoc(t, e.val, shift + HAMT_BITS, hash, key, val, added, edit);
+        if (child == e.val) {
+            return n;
+        }
+        c = node_edit(t, n, i, 0, edit);
+        if (!owned) {
+            node_release(t, e.val);
+        }
+        c->entries[i].val = child;
+        return c;
+    }
+
+    if (t->eq(e.key, key)) {
+        c = node_edit(t, n, i, 0, edit);
+        t->release(c->entries[i].val);
+        t->release(key);
+        c->entries[i].val = val;
+        return c;
+    }
+
+    c = node_edit(t, n, i, 0, edit);
+    c->entries[i].key = NULL;
+    c->entries[i].val = node_pair(e.key, e.val, t->hash(e.key), key, val, hash,
+                                  shift + HAMT_BITS, edit);
+    *added = 1;
+    return c;
+}
+
+hamt_t *hamt_assoc(hamt_t *t, void *key, void *val) {
+    uint32_t hash = t->hash(key);
+    hamt_node *root;
+    int added = 0;
+
+    if (t->root == NULL) {
+        root = node_new(1, 0);
+        root->bitmap = (uint32_t)1 << (hash & HAMT_MASK);
+        root->entries[0].key = key;
+        root->entries[0].val = val;
+        return hamt_wrap(t, root, 1);
+    }
+    root = node_assoc(t, t->root, 0, hash, key, val, &added, 0);
+    return hamt_wrap(t, root, t->count + added);
+}
+
+/*
+ * Bulk build. Nodes created here are tagged with a fresh edit id, which
+ * lets every later insertion in the same build grow them in place rather
+ * than copying the whole path for each key.
+ */
+hamt_t *hamt_build(hamt_t *t, size_t n, void **keys, void **vals) {
+    unsigned edit = ++hamt_edit;
+    hamt_node *root;
+    size_t count = t->count;
+
+    if (edit == 0) {
+        edit = ++hamt_edit;
+    }
+
+    if (t->root == NULL) {
+        root = node_new(0, edit);
+    } else {
+        t->root->refs++;
+        root = t->root;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        int added = 0;
+        int owned = root->edit == edit;
+        hamt_node *next = node_assoc(t, root, 0, t->hash(keys[i]), keys[i], vals[i], &added, edit);
+        if (!owned) {
+            node_release(t, root);
+        }
+        root = next;
+        count += added;
+    }
+
+    if (count == 0) {
+        node_release(t, root);
+        root = NULL;
+    }
+    return hamt_wrap(t, root, count);
+}
+
+/*
+ * Removal
+ */
+
+static hamt_node *node_dissoc(hamt_t *t, hamt_node *n, int shift, uint32_t hash,
+                              void *key, int *removed) {
+    hamt_node *c;
+
+    if (n->collision) {
+        for (int i = 0; i < n->count; ++i) {
+            if (t->eq(n->entries[i].key, key)) {
+                *removed = 1;
+                return node_copy(t, n, i, -1, 0);
+            }
+        }
+        n->refs++;
+        return n;
+    }
+
+    uint32_t bit = (uint32_t)1 << ((hash >> shift) & HAMT_MASK);
+    int i = popcount(n->bitmap & (bit - 1));
+
+    if (!(n->bitmap & bit)) {
+        n->refs++;
+        return n;
+    }
+
+    hamt_entry *e = &n->entries[i];
+
+    if (e->key) {
+        if (!t->eq(e->key, key)) {
+            n->refs++;
+            return n;
+        }
+        *removed = 1;
+        c = node_copy(t, n, i, -1, 0);
+        c->bitmap &= ~bit;
+        return c;
+    }
+
+    hamt_node *child = node_dissoc(t, e->val, shift + HAMT_BITS, hash, key, removed);
+    if (!*removed) {
+        node_release(t, child);
+        n->refs++;
+        return n;
+    }
+
+    c = node_copy(t, n, i, 0, 0);
+    node_release(t, c->entries[i].val);
+    c->entries[i].val = child;
+
+    if (child->count == 0) {
+        /* the child is gone entirely */
+        hamt_node *d = node_copy(t, c, i, -1, 0);
+        d->bitmap &= ~bit;
+        node_release(t, c);
+        return d;
+    }
+
+    if (child->count == 1 && child->entries[0].key) {
+        /* a lone key moves back up into this node */
+        c->entries[i] = child->entries[0];
+        entry_retain(t, &c->entries[i]);
+        node_release(t, child);
+    }
+    return c;
+}
+
+hamt_t *hamt_dissoc(hamt_t *t, void *key) {
+    hamt_node *root;
+    int removed = 0;
+
+    if (t->root == NULL) {
+        return hamt_copy(t);
+    }
+    root = node_dissoc(t, t->root, 0, t->hash(key), key, &removed);
+    if (root->count == 0) {
+        node_release(t, root);
+        root = NULL;
+    }
+    return hamt_wrap(t, root, t->count - removed);
+}
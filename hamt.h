@@ -0,0 +1,77 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Persistent hash map backed by a hash array mapped trie (HAMT).
+ *
+ * Like rrb.h every update returns a new map sharing all untouched nodes
+ * with its input. Each level of the trie consumes five bits of the key's
+ * hash and stores only the occupied slots, indexed by the popcount of a
+ * 32 bit bitmap. Keys whose hashes fully collide share a collision node.
+ *
+ * The map takes ownership of keys and values passed to it. `retain` and
+ * `release` are called on both when they become shared or are dropped.
+ */
+
+#ifndef HAMT_H
+#define HAMT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t (*hamt_hash_t)(void *key);
+typedef int (*hamt_eq_t)(void *a, void *b);
+typedef void *(*hamt_retain_t)(void *x);
+typedef void (*hamt_release_t)(void *x);
+typedef void (*hamt_each_t)(void *key, void *val, void *d);
+
+struct hamt_node;
+
+/* seven levels of five hash bits, then a collision node */
+#define HAMT_DEPTH  8
+
+typedef struct hamt_t {
+    size_t count;
+    struct hamt_node *root;
+    hamt_hash_t hash;
+    hamt_eq_t eq;
+    hamt_retain_t retain;
+    hamt_release_t release;
+} hamt_t;
+
+/* position of an in-order walk over a map, see hamt_iter_next */
+typedef struct {
+    struct hamt_node *nodes[HAMT_DEPTH];
+    int next[HAMT_DEPTH];
+    int depth;
+} hamt_iter;
+
+hamt_t *hamt_new(hamt_hash_t hash, hamt_eq_t eq,
+                 hamt_retain_t retain, hamt_release_t release);
+hamt_t *hamt_copy(hamt_t *t);
+void hamt_delete(hamt_t *t);
+
+/*
+ * Delete t, handing each key and value it held the last reference to to
+ * f instead of releasing them. Lets the caller release nested entries
+ * without recursing through `release`.
+ */
+void hamt_delete_each(hamt_t *t, hamt_each_t f, void *d);
+
+size_t hamt_count(hamt_t *t);
+void *hamt_get(hamt_t *t, void *key);
+void hamt_foreach(hamt_t *t, hamt_each_t f, void *d);
+
+/*
+ * Visit the entries of t one at a time: each hamt_iter_next stores the
+ * next key and value and returns 1, or returns 0 once all are visited.
+ * t must outlive the walk.
+ */
+void hamt_iter_init(hamt_iter *it, hamt_t *t);
+int hamt_iter_next(hamt_iter *it, void **key, void **val);
+
+hamt_t *hamt_assoc(hamt_t *t, void *key, void *val);
+hamt_t *hamt_dissoc(hamt_t *t, void *key);
+hamt_t *hamt_build(hamt_t *t, size_t n, void **keys, void **vals);
+
+#endif /* HAMT_H */
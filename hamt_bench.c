@@ -0,0 +1,245 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Lookup benchmark for hamt.c, see `make bench`
+ *
+ * Times random hits in a HAMT against a linear scan of a linked list (how
+ * lookups were written before LVAL_MAP) and a mutable open addressing
+ * table with linear probing. Keys are boxed longs hashed with FNV-1a like
+ * lval_hash does. The keys to look up are drawn before the clock starts,
+ * and each figure is the best of BENCH_RUNS runs. Also times building a
+ * map of BENCH_BUILD keys with hamt_build and with hamt_assoc one key at
+ * a time.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hamt.h"
+
+#define BENCH_BUILD 100000
+#define BENCH_RUNS  3
+
+/* lookups per timed run, and how many key comparisons the list may make */
+#define BENCH_LOOKUPS   4000000
+#define BENCH_SCANS     400000000
+#define BENCH_PROBES    65536
+
+typedef struct list_node {
+    long *key;
+    long *val;
+    struct list_node *next;
+} list_node;
+
+typedef struct {
+    long **keys;
+    long **vals;
+    size_t mask;
+} open_table;
+
+static volatile long sink;
+
+typedef enum { BENCH_HAMT, BENCH_LIST, BENCH_OPEN } bench_kind;
+
+typedef struct {
+    hamt_t *map;
+    list_node *list;
+    open_table *table;
+    long *probes;
+} bench_data;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t key_hash(void *x) {
+    const unsigned char *b = x;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(long); ++i) {
+        h = (h ^ b[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int key_eq(void *a, void *b) {
+    return *(long *)a == *(long *)b;
+}
+
+static void *key_retain(void *x) {
+    return x;
+}
+
+static void key_release(void *x) {
+    (void)x;
+}
+
+static hamt_t *map_new(void) {
+    return hamt_new(key_hash, key_eq, key_retain, key_release);
+}
+
+static open_table open_build(size_t n, long *keys) {
+    open_table t;
+    size_t cap = 1;
+    while (cap < 2 * n) {
+        cap <<= 1;
+    }
+    t.keys = calloc(cap, sizeof(long *));
+    t.vals = calloc(cap, sizeof(long *));
+    t.mask = cap - 1;
+    for (size_t i = 0; i < n; ++i) {
+        size_t j = key_hash(&keys[i]) & t.mask;
+        while (t.keys[j] != NULL) {
+            j = (j + 1) & t.mask;
+        }
+        t.keys[j] = &keys[i];
+        t.vals[j] = &keys[i];
+    }
+    return t;
+}
+
+static long *open_get(open_table *t, long *key) {
+    size_t j = key_hash(key) & t->mask;
+    while (t->keys[j] != NULL) {
+        if (*t->keys[j] == *key) {
+            return t->vals[j];
+        }
+        j = (j + 1) & t->mask;
+    }
+    return NULL;
+}
+
+static long *list_get(list_node *l, long *key) {
+    for (; l != NULL; l = l->next) {
+        if (*l->key == *key) {
+            return l->val;
+        }
+    }
+    return NULL;
+}
+
+/* ns per lookup over iters lookups, best of BENCH_RUNS */
+static double bench_best(bench_data *d, bench_kind kind, long iters) {
+    double best = 0;
+    for (int run = 0; run < BENCH_RUNS; ++run) {
+        long sum = 0;
+        double start = now();
+        for (long i = 0; i < iters; ++i) {
+            long *probe = &d->probes[i & (BENCH_PROBES - 1)];
+            switch (kind) {
+                case BENCH_HAMT:
+                    sum += *(long *)hamt_get(d->map, probe);
+                    break;
+
+                case BENCH_LIST:
+                    sum += *list_get(d->list, probe);
+                    break;
+
+                case BENCH_OPEN:
+                    sum += *open_get(d->table, probe);
+                    break;
+            }
+        }
+        double ns = (now() - start) / iters * 1e9;
+        sink += sum;
+        if (run == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+static void bench_lookup(size_t n) {
+    long *keys = malloc(n * sizeof(long));
+    list_node *nodes = malloc(n * sizeof(list_node));
+    void **ks = malloc(n * sizeof(void *));
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = (long)i * 7919;
+        ks[i] = &keys[i];
+        nodes[i].key = &keys[i];
+        nodes[i].val = &keys[i];
+        nodes[i].next = i + 1 < n ? &nodes[i + 1] : NULL;
+    }
+
+    hamt_t *empty = map_new();
+    hamt_t *m = hamt_build(empty, n, ks, ks);
+    hamt_delete(empty);
+    open_table t = open_build(n, keys);
+
+    bench_data d;
+    d.map = m;
+    d.list = nodes;
+    d.table = &t;
+    d.probes = malloc(BENCH_PROBES * sizeof(long));
+    for (size_t i = 0; i < BENCH_PROBES; ++i) {
+        d.probes[i] = keys[rand() % n];
+    }
+
+    /* a scan of the list makes n/2 comparisons on average */
+    long list_iters = BENCH_SCANS / (long)n;
+    if (list_iters > BENCH_LOOKUPS) {
+        list_iters = BENCH_LOOKUPS;
+    }
+
+    double hamt_ns = bench_best(&d, BENCH_HAMT, BENCH_LOOKUPS);
+    double list_ns = bench_best(&d, BENCH_LIST, list_iters);
+    double open_ns = bench_best(&d, BENCH_OPEN, BENCH_LOOKUPS);
+
+    printf("%-8zu %9.0f ns %14.0f ns %16.0f ns\n", n, hamt_ns, list_ns, open_ns);
+
+    free(d.probes);
+    hamt_delete(m);
+    free(t.keys);
+    free(t.vals);
+    free(ks);
+    free(nodes);
+    free(keys);
+}
+
+static void bench_build(void) {
+    long *keys = malloc(BENCH_BUILD * sizeof(long));
+    void **ks = malloc(BENCH_BUILD * sizeof(void *));
+    for (size_t i = 0; i < BENCH_BUILD; ++i) {
+        keys[i] = (long)i * 7919;
+        ks[i] = &keys[i];
+    }
+
+    double start = now();
+    hamt_t *empty = map_new();
+    hamt_t *m = hamt_build(empty, BENCH_BUILD, ks, ks);
+    double build_ms = (now() - start) * 1e3;
+    hamt_delete(empty);
+    hamt_delete(m);
+
+    start = now();
+    m = map_new();
+    for (size_t i = 0; i < BENCH_BUILD; ++i) {
+        hamt_t *next = hamt_assoc(m, ks[i], ks[i]);
+        hamt_delete(m);
+        m = next;
+    }
+    double assoc_ms = (now() - start) * 1e3;
+    hamt_delete(m);
+
+    printf("inserting %d keys: hamt_build %.0f ms, hamt_assoc %.0f ms\n",
+           BENCH_BUILD, build_ms, assoc_ms);
+
+    free(ks);
+    free(keys);
+}
+
+int main(void) {
+    size_t sizes[] = { 8, 64, 1000, 100000 };
+    srand(1);
+    printf("%-8s %12s %17s %19s\n", "n", "hamt", "linear list", "open addressing");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        bench_lookup(sizes[i]);
+    }
+    bench_build();
+    return 0;
+}
@@ -12,18 +12,37 @@
 #include <editline/history.h>
 
 #include "mpc.h"
+#include "rrb.h"
+#include "hamt.h"
+#include "lstr.h"
 #include "lispy.h"
+#include "lnum.h"
+#include "reader.h"
+#include "readcache.h"
+#include "watch.h"
 
 #define VERSION          0.9
 #define BUFF_SIZE       2048
-#define NUM_PARSERS        6
 
-mpc_parser_t* Number;
-mpc_parser_t* Decimal;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Symbol;
-mpc_parser_t* Expr;
-mpc_parser_t* Lispy;
+#ifdef MPC_READER
+/* the grammar in reader.h built from combinators that produce lvals */
+mpc_parser_t* LvalExpr;
+mpc_parser_t* LvalLispy;
+#endif
+
+/* record constructors and accessors bound by defrecord, keyed by name */
+hamt_t* Records;
+
+/* changes whenever Records does, and never to a value it has had before */
+unsigned long RecordsVersion;
+
+int LvalMaxDepth = LVAL_MAX_DEPTH;
+
+/* what previously seen input read to */
+read_cache* ReadCache;
+
+#define LASSERT(args, cond, err) \
+    if (!(cond)) { lval_del(args); return lval_err(err); }
 
 
 /*
@@ -34,6 +53,7 @@ mpc_parser_t* Lispy;
 lval* lval_num(long x) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_NUM;
+    v->refs = 1;
     v->num = x;
     return v;
 }
@@ -42,6 +62,7 @@ lval* lval_num(long x) {
 lval* lval_dbl(double x) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_DBL;
+    v->refs = 1;
     v->dbl = x;
     return v;
 }
@@ -60,16 +81,24 @@ lval* lval_err(int x) {
 lval* lval_err(char* m) {
     lval *v = malloc(sizeof(lval));
     v->type = LVAL_ERR;
+    v->refs = 1;
     v->err = malloc(strlen(m) + 1);
     strcpy(v->err, m);
     return v;
 }
 
 lval* lval_sym(char *s) {
+    return lval_sym_n(s, strlen(s));
+}
+
+/* symbol from the first n bytes of s */
+lval* lval_sym_n(const char *s, size_t n) {
     lval *v = malloc(sizeof(lval));
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    v->refs = 1;
+    v->sym = malloc(n + 1);
+    memcpy(v->sym, s, n);
+    v->sym[n] = '\0';
     return v;
 }
 
@@ -77,11 +106,537 @@ lval* lval_sym(char *s) {
 lval* lval_sexpr(void) {
     lval *v = malloc(sizeof(lval));
     v->type = LVAL_SEXPR;
+    v->refs = 1;
     v->count = 0;
     v->cell = NULL;
     return v;
 }
 
+/* string type, takes ownership of s */
+lval* lval_str(lstr_t s) {
+    lval *v = malloc(sizeof(lval));
+    v->type = LVAL_STR;
+    v->refs = 1;
+    v->str = s;
+    return v;
+}
+
+/* lazy sequence type, takes ownership of s */
+lval* lval_seq(lseq *s) {
+    lval *v = malloc(sizeof(lval));
+    v->type = LVAL_SEQ;
+    v->refs = 1;
+    v->seq = s;
+    return v;
+}
+
+/* a sequence over src (a vector, or NULL for start, start+step, ... end) */
+static lseq* lseq_new(lval* src, long start, long end, long step) {
+    lseq* s = malloc(sizeof(lseq));
+    s->src = src;
+    s->start = start;
+    s->end = end;
+    s->step = step;
+    s->count = 0;
+    s->stages = NULL;
+    return s;
+}
+
+/* append a stage to s, which takes ownership of f */
+static void lseq_push(lseq* s, int kind, lval* f, long n) {
+    s->count++;
+    s->stages = realloc(s->stages, sizeof(lseq_stage) * s->count);
+    s->stages[s->count - 1].kind = kind;
+    s->stages[s->count - 1].f = f;
+    s->stages[s->count - 1].n = n;
+}
+
+static lseq* lseq_copy(lseq* s) {
+    lseq* c = lseq_new(s->src ? lval_copy(s->src) : NULL, s->start, s->end, s->step);
+    for (int i = 0; i < s->count; ++i) {
+        lseq_stage* st = &s->stages[i];
+        lseq_push(c, st->kind, st->f ? lval_copy(st->f) : NULL, st->n);
+    }
+    return c;
+}
+
+static void lseq_delete(lseq* s) {
+    if (s->src) {
+        lval_del(s->src);
+    }
+    for (int i = 0; i < s->count; ++i) {
+        if (s->stages[i].f) {
+            lval_del(s->stages[i].f);
+        }
+    }
+    free(s->stages);
+    free(s);
+}
+
+static lval* lseq_count(lseq* s);
+static lval* lseq_list(lseq* s);
+
+static char* str_dup(const char* s) {
+    char* d = malloc(strlen(s) + 1);
+    strcpy(d, s);
+    return d;
+}
+
+static void lrec_type_release(lrec_type* t) {
+    if (--t->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < t->count; ++i) {
+        free(t->fields[i]);
+    }
+    free(t->fields);
+    free(t->name);
+    free(t);
+}
+
+/*
+ * Record instance of type t. The slots are laid out contiguously after
+ * the type pointer and start out NULL for the caller to fill in.
+ */
+lval* lval_rec(lrec_type *t) {
+    lval *v = malloc(sizeof(lval));
+    v->type = LVAL_REC;
+    v->refs = 1;
+    v->rec = malloc(sizeof(lrec) + sizeof(lval*) * t->count);
+    v->rec->type = t;
+    t->refs++;
+    for (int i = 0; i < t->count; ++i) {
+        v->rec->slots[i] = NULL;
+    }
+    return v;
+}
+
+/*
+ * Vector elements may be shared between several versions of a vector,
+ * so they are reference counted. Elements are never handed out directly,
+ * builtins always work on a copy.
+ */
+static void* lval_retain(void* x) {
+    ((lval*)x)->refs++;
+    return x;
+}
+
+static void lval_release(void* x) {
+    lval_del(x);
+}
+
+/* persistent vector type */
+lval* lval_vec(rrb_t *t) {
+    lval *v = malloc(sizeof(lval));
+    v->type = LVAL_VEC;
+    v->refs = 1;
+    v->vec = t == NULL ? rrb_new(lval_retain, lval_release) : t;
+    return v;
+}
+
+/*
+ * Nested lists, vectors, maps and records are walked with an explicit
+ * stack of frames, each holding a collection and the index of the next
+ * element to visit in it, so depth is limited by memory rather than by
+ * the C stack.
+ */
+#define LVAL_STACK 64
+
+/* position of a walk over a map, which gives each key then its value */
+typedef struct {
+    hamt_iter it;
+    void *val;
+    uint32_t h;
+} lval_cursor;
+
+typedef struct {
+    lval *v;
+    int i;
+    lval *copy;
+    uint32_t h;
+    lval_cursor *map;
+} lval_frame;
+
+typedef struct {
+    lval_frame *frames;
+    int depth;
+    int cap;
+    lval_frame fixed[LVAL_STACK];
+} lval_stack;
+
+static void lval_stack_init(lval_stack *s) {
+    s->frames = s->fixed;
+    s->depth = 0;
+    s->cap = LVAL_STACK;
+}
+
+static lval_frame* lval_stack_push(lval_stack *s, lval *v) {
+    if (s->depth == s->cap) {
+        s->cap *= 2;
+        if (s->frames == s->fixed) {
+            s->frames = malloc(sizeof(lval_frame) * s->cap);
+            memcpy(s->frames, s->fixed, sizeof(s->fixed));
+        } else {
+            s->frames = realloc(s->frames, sizeof(lval_frame) * s->cap);
+        }
+    }
+    lval_frame *f = &s->frames[s->depth++];
+    f->v = v;
+    f->i = 0;
+    f->copy = NULL;
+    f->h = 0;
+    f->map = NULL;
+    return f;
+}
+
+static void lval_stack_pop(lval_stack *s) {
+    free(s->frames[--s->depth].map);
+}
+
+static void lval_stack_free(lval_stack *s) {
+    while (s->depth) {
+        lval_stack_pop(s);
+    }
+    if (s->frames != s->fixed) {
+        free(s->frames);
+    }
+}
+
+/* whether v holds other lvals that a walk descends into */
+static int lval_is_nested(lval *v) {
+    return v->type == LVAL_SEXPR || v->type == LVAL_VEC ||
+           v->type == LVAL_MAP || v->type == LVAL_REC;
+}
+
+/* element count and element i of a list, vector or record */
+static int lval_elems(lval *v) {
+    switch (v->type) {
+        case LVAL_VEC:
+            return (int)rrb_count(v->vec);
+
+        case LVAL_REC:
+            return v->rec->type->count;
+
+        default:
+            return v->count;
+    }
+}
+
+static lval* lval_elem(lval *v, int i) {
+    switch (v->type) {
+        case LVAL_VEC:
+            return rrb_nth(v->vec, i);
+
+        case LVAL_REC:
+            return v->rec->slots[i];
+
+        default:
+            return v->cell[i];
+    }
+}
+
+/* next element of the collection in f, or NULL once all are visited */
+static lval* lval_frame_next(lval_frame *f) {
+    if (f->v->type != LVAL_MAP) {
+        return f->i < lval_elems(f->v) ? lval_elem(f->v, f->i++) : NULL;
+    }
+    if (f->map == NULL) {
+        f->map = malloc(sizeof(lval_cursor));
+        hamt_iter_init(&f->map->it, f->v->map);
+    }
+    if (f->i++ % 2) {
+        return f->map->val;
+    }
+    void *key;
+    return hamt_iter_next(&f->map->it, &key, &f->map->val) ? key : NULL;
+}
+
+static uint32_t hash_bytes(uint32_t h, const void *p, size_t n) {
+    const unsigned char *b = p;
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ b[i]) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t lval_hash(void* x);
+
+/* what the hash of v starts from, before any elements are folded in */
+static uint32_t lval_hash_seed(lval *v) {
+    uint32_t h = hash_bytes(2166136261u, &v->type, sizeof(v->type));
+    if (v->type == LVAL_REC) {
+        h = hash_bytes(h, v->rec->type->name, strlen(v->rec->type->name));
+    }
+    return h;
+}
+
+/* hash of anything but a list, vector, map or record */
+static uint32_t lval_hash_atom(lval *v) {
+    uint32_t h = lval_hash_seed(v);
+    switch (v->type) {
+        case LVAL_NUM:
+            return hash_bytes(h, &v->num, sizeof(v->num));
+
+        case LVAL_DBL: {
+            /* -0.0 == 0.0, so both hash as 0.0 */
+            double d = v->dbl == 0 ? 0.0 : v->dbl;
+            return hash_bytes(h, &d, sizeof(d));
+        }
+
+        case LVAL_ERR:
+            return hash_bytes(h, v->err, strlen(v->err));
+
+        case LVAL_SYM:
+            return hash_bytes(h, v->sym, strlen(v->sym));
+
+        case LVAL_STR:
+            return hash_bytes(h, lstr_cstr(&v->str), lstr_len(&v->str));
+
+        case LVAL_SEQ: {
+            /* a sequence hashes and compares as what it yields */
+            lval* l = lseq_list(v->seq);
+            for (int i = 0; i < l->count; ++i) {
+                h = h * 31 + lval_hash(l->cell[i]);
+            }
+            lval_del(l);
+            return h;
+        }
+
+        default:
+            return h;
+    }
+}
+
+/* hash of an lval, consistent with lval_eq */
+static uint32_t lval_hash(void* x) {
+    lval *v = x;
+    if (!lval_is_nested(v)) {
+        return lval_hash_atom(v);
+    }
+
+    lval_stack s;
+    lval_stack_init(&s);
+    lval_stack_push(&s, v)->h = lval_hash_seed(v);
+    uint32_t h;
+    while (1) {
+        lval_frame *f = &s.frames[s.depth - 1];
+        lval *y = lval_frame_next(f);
+        if (y != NULL && lval_is_nested(y)) {
+            lval_stack_push(&s, y)->h = lval_hash_seed(y);
+            continue;
+        }
+        if (y != NULL) {
+            h = lval_hash_atom(y);
+        } else {
+            h = f->h;
+            lval_stack_pop(&s);
+            if (s.depth == 0) {
+                break;
+            }
+            f = &s.frames[s.depth - 1];
+        }
+
+        if (f->v->type != LVAL_MAP) {
+            f->h = f->h * 31 + h;
+        } else if (f->i % 2) {
+            f->map->h = h;
+        } else {
+            /* combined with + so the result does not depend on trie order */
+            f->h += f->map->h * 31 + h;
+        }
+    }
+    lval_stack_free(&s);
+    return h;
+}
+
+static int lval_eq(void* x, void* y);
+
+/* compare a and b, but not the elements of lists, vectors, maps or records */
+static int lval_eq_shallow(lval *a, lval *b) {
+    if (a == b) {
+        return 1;
+    }
+    if (a->type != b->type) {
+        return 0;
+    }
+    switch (a->type) {
+        case LVAL_NUM:
+            return a->num == b->num;
+
+        case LVAL_DBL:
+            return a->dbl == b->dbl;
+
+        case LVAL_ERR:
+            return strcmp(a->err, b->err) == 0;
+
+        case LVAL_SYM:
+            return strcmp(a->sym, b->sym) == 0;
+
+        case LVAL_STR:
+            return lstr_cmp(&a->str, &b->str) == 0;
+
+        case LVAL_SEXPR:
+            return a->count == b->count;
+
+        case LVAL_VEC:
+            return rrb_count(a->vec) == rrb_count(b->vec);
+
+        case LVAL_MAP:
+            return hamt_count(a->map) == hamt_count(b->map);
+
+        case LVAL_REC:
+            return a->rec->type == b->rec->type;
+
+        case LVAL_SEQ: {
+            lval* l = lseq_list(a->seq);
+            lval* m = lseq_list(b->seq);
+            int eq = lval_eq(l, m);
+            lval_del(l);
+            lval_del(m);
+            return eq;
+        }
+    }
+    return 0;
+}
+
+/* structural equality of two lvals */
+static int lval_eq(void* x, void* y) {
+    lval *a = x;
+    lval *b = y;
+    if (!lval_eq_shallow(a, b)) {
+        return 0;
+    }
+    if (a == b || !lval_is_nested(a)) {
+        return 1;
+    }
+
+    /* each frame walks a collection of a, with its counterpart in b as copy */
+    lval_stack s;
+    lval_stack_init(&s);
+    lval_stack_push(&s, a)->copy = b;
+    int eq = 1;
+    while (eq && s.depth) {
+        lval_frame *f = &s.frames[s.depth - 1];
+        lval *u = lval_frame_next(f);
+        lval *w;
+        if (u == NULL) {
+            lval_stack_pop(&s);
+            continue;
+        }
+        if (f->v->type == LVAL_MAP) {
+            /* keys are matched by lookup, so only their values are compared */
+            w = hamt_get(f->copy->map, u);
+            u = lval_frame_next(f);
+        } else {
+            w = lval_elem(f->copy, f->i - 1);
+        }
+
+        if (w == NULL || !lval_eq_shallow(u, w)) {
+            eq = 0;
+        } else if (u != w && lval_is_nested(u)) {
+            lval_stack_push(&s, u)->copy = w;
+        }
+    }
+    lval_stack_free(&s);
+    return eq;
+}
+
+/* persistent hash map type, keys and values are shared like vector elements */
+lval* lval_map(hamt_t *t) {
+    lval *v = malloc(sizeof(lval));
+    v->type = LVAL_MAP;
+    v->refs = 1;
+    v->map = t == NULL ? hamt_new(lval_hash, lval_eq, lval_retain, lval_release) : t;
+    return v;
+}
+
+/* copy anything but an S-expression */
+static lval* lval_copy_atom(lval *v) {
+    lval *x = malloc(sizeof(lval));
+    x->type = v->type;
+    x->refs = 1;
+    switch (v->type) {
+        case LVAL_NUM:
+            x->num = v->num;
+            break;
+
+        case LVAL_DBL:
+            x->dbl = v->dbl;
+            break;
+
+        case LVAL_ERR:
+            x->err = malloc(strlen(v->err) + 1);
+            strcpy(x->err, v->err);
+            break;
+
+        case LVAL_SYM:
+            x->sym = malloc(strlen(v->sym) + 1);
+            strcpy(x->sym, v->sym);
+            break;
+
+        case LVAL_VEC:
+            x->vec = rrb_copy(v->vec);
+            break;
+
+        case LVAL_MAP:
+            x->map = hamt_copy(v->map);
+            break;
+
+        case LVAL_STR:
+            x->str = lstr_copy(&v->str);
+            break;
+
+        case LVAL_SEQ:
+            x->seq = lseq_copy(v->seq);
+            break;
+
+        case LVAL_REC:
+            free(x);
+            x = lval_rec(v->rec->type);
+            for (int i = 0; i < v->rec->type->count; ++i) {
+                x->rec->slots[i] = lval_retain(v->rec->slots[i]);
+            }
+            break;
+    }
+    return x;
+}
+
+/* empty list with room for every element of v */
+static lval* lval_copy_list(lval *v) {
+    lval *x = lval_sexpr();
+    x->count = v->count;
+    x->cell = malloc(sizeof(lval*) * x->count);
+    return x;
+}
+
+lval* lval_copy(lval *v) {
+    if (v->type != LVAL_SEXPR) {
+        return lval_copy_atom(v);
+    }
+
+    lval_stack s;
+    lval_stack_init(&s);
+    lval *root = lval_copy_list(v);
+    lval_stack_push(&s, v)->copy = root;
+    while (s.depth) {
+        lval_frame *f = &s.frames[s.depth - 1];
+        if (f->i == f->v->count) {
+            s.depth--;
+            continue;
+        }
+        lval *x = f->v->cell[f->i];
+        if (x->type == LVAL_SEXPR) {
+            lval *y = lval_copy_list(x);
+            f->copy->cell[f->i++] = y;
+            lval_stack_push(&s, x)->copy = y;
+        } else {
+            f->copy->cell[f->i++] = lval_copy_atom(x);
+        }
+    }
+    lval_stack_free(&s);
+    return root;
+}
+
 /*
  * Destructors
  */
@@ -91,8 +646,32 @@ int destroy_lval(lval* v) {
     return 0;
 }
 
-/* Free memory */
-int lval_del(lval *v) {
+/* add an element dropped by a vector or map to the list in d */
+static void lval_collect(void* x, void* d) {
+    lval *l = d;
+    l->cell[l->count++] = x;
+}
+
+static void lval_collect_entry(void* key, void* val, void* d) {
+    lval_collect(key, d);
+    lval_collect(val, d);
+}
+
+/* empty list with room for n elements */
+static lval* lval_room(size_t n) {
+    lval *l = lval_sexpr();
+    l->cell = malloc(sizeof(lval*) * n);
+    return l;
+}
+
+/*
+ * Free anything but an S-expression, whose refs have already hit zero.
+ * The elements a vector, map or record held the last reference to are
+ * not released but returned as a list, for lval_del to release on its
+ * stack. Returns NULL for every other type.
+ */
+static lval* lval_free(lval *v) {
+    lval *rest = NULL;
     switch (v->type) {
         case LVAL_NUM:
             break;
@@ -105,21 +684,73 @@ int lval_del(lval *v) {
             free(v->sym);
             break;
 
-        case LVAL_SEXPR:
-            for (int i = 0; i < v->count; ++i) {
-                lval_del(v->cell[i]);
+        case LVAL_VEC:
+            rest = lval_room(rrb_count(v->vec));
+            rrb_delete_each(v->vec, lval_collect, rest);
+            break;
+
+        case LVAL_MAP:
+            rest = lval_room(2 * hamt_count(v->map));
+            hamt_delete_each(v->map, lval_collect_entry, rest);
+            break;
+
+        case LVAL_STR:
+            lstr_delete(&v->str);
+            break;
+
+        case LVAL_SEQ:
+            lseq_delete(v->seq);
+            break;
+
+        case LVAL_REC:
+            rest = lval_room(v->rec->type->count);
+            for (int i = 0; i < v->rec->type->count; ++i) {
+                lval_collect(v->rec->slots[i], rest);
             }
-            free(v->cell);
+            lrec_type_release(v->rec->type);
+            free(v->rec);
             break;
     }
     free(v);
-    return 0;
+    return rest;
 }
 
-lval* lval_read_num(mpc_ast_t *t) {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+/* Free memory */
+int lval_del(lval *v) {
+    if (--v->refs > 0) {
+        return 0;
+    }
+    if (v->type != LVAL_SEXPR) {
+        v = lval_free(v);
+        if (v == NULL) {
+            return 0;
+        }
+    }
+
+    lval_stack s;
+    lval_stack_init(&s);
+    lval_stack_push(&s, v);
+    while (s.depth) {
+        lval_frame *f = &s.frames[s.depth - 1];
+        if (f->i == f->v->count) {
+            free(f->v->cell);
+            free(f->v);
+            s.depth--;
+            continue;
+        }
+        lval *x = f->v->cell[f->i++];
+        if (--x->refs > 0) {
+            continue;
+        }
+        if (x->type != LVAL_SEXPR) {
+            x = lval_free(x);
+        }
+        if (x != NULL) {
+            lval_stack_push(&s, x);
+        }
+    }
+    lval_stack_free(&s);
+    return 0;
 }
 
 lval* lval_add(lval *v, lval *x) {
@@ -129,49 +760,183 @@ lval* lval_add(lval *v, lval *x) {
 	return v;
 }
 
-lval* lval_read(mpc_ast_t* t) {
+#ifdef MPC_READER
+/*
+ * Fold and apply callbacks for LvalLispy. Every token is converted to an
+ * lval the moment it is matched and its string freed straight away, so a
+ * parse never holds more than the lvals it has produced so far.
+ */
+static mpc_val_t* lvalf_number(mpc_val_t* x) {
+    long n;
+    lval* v = lnum_long(x, strlen(x), &n) ? lval_num(n) : lval_err("invalid number");
+    free(x);
+    return v;
+}
+
+static mpc_val_t* lvalf_decimal(mpc_val_t* x) {
+    double d = lnum_double(x, strlen(x));
+    free(x);
+    return lval_dbl(d);
+}
+
+static mpc_val_t* lvalf_string(mpc_val_t* x) {
+    /* strip the quotes and resolve escapes */
+    size_t len = strlen(x) - 2;
+    char* s = malloc(len + 1);
+    memcpy(s, (char*)x + 1, len);
+    s[len] = '\0';
+    free(x);
+    s = mpcf_unescape(s);
+    lval* v = lval_str(lstr_new(s, strlen(s)));
+    free(s);
+    return v;
+}
+
+static mpc_val_t* lvalf_symbol(mpc_val_t* x) {
+    lval* v = lval_sym(x);
+    free(x);
+    return v;
+}
 
-  /* If Symbol or Number return conversion to that type */
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+static mpc_val_t* lvalf_sexpr(int n, mpc_val_t** xs) {
+    lval* v = lval_sexpr();
+    if (n > 0) {
+        v->count = n;
+        v->cell = malloc(sizeof(lval*) * n);
+        memcpy(v->cell, xs, sizeof(lval*) * n);
+    }
+    return v;
+}
 
-  /* If root (>) or sexpr then create empty list */
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
+static void lvalf_del(mpc_val_t* x) {
+    lval_del(x);
+}
 
-#ifdef DEBUG
-  printf("%d\n", x);
-  if (x == NULL) {
-      printf("Warning: x is NULL\n");
-  }
+/*
+ * Build the grammar in reader.h, one combinator per rule with the same
+ * regexes, so that the rule's fold or apply callback runs on each match.
+ * mpca_lang can only build an mpc_ast_t, which is why this is not
+ * written in its notation.
+ */
+static void lval_parser_new(void) {
+    LvalExpr = mpc_new("expr");
+
+    mpc_parser_t* number  = mpc_apply(mpc_tok(mpc_re("-?[0-9]+")), lvalf_number);
+    mpc_parser_t* decimal = mpc_apply(mpc_tok(mpc_re("-?[0-9]+\\.[0-9]+")), lvalf_decimal);
+    mpc_parser_t* string  = mpc_apply(mpc_tok(mpc_re("\"(\\\\.|[^\"])*\"")), lvalf_string);
+    mpc_parser_t* symbol  = mpc_apply(mpc_tok(mpc_re("[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+")), lvalf_symbol);
+    mpc_parser_t* sexpr   = mpc_tok_parens(mpc_many(lvalf_sexpr, LvalExpr), lvalf_del);
+
+    mpc_define(LvalExpr, mpc_or(5, decimal, number, string, symbol, sexpr));
+    LvalLispy = mpc_whole(mpc_stripl(mpc_many(lvalf_sexpr, LvalExpr)), lvalf_del);
+
+    mpc_optimise(LvalExpr);
+    mpc_optimise(LvalLispy);
+}
 #endif
-  /* Fill this list with any valid expression contained within */
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
-  }
 
-  return x;
+/* brackets around the elements of a list, vector, map or record */
+static void lval_open_print(lval *v) {
+    switch (v->type) {
+        case LVAL_VEC:
+            putchar('[');
+            break;
+
+        case LVAL_MAP:
+            putchar('{');
+            break;
+
+        case LVAL_REC:
+            printf("#%s{", v->rec->type->name);
+            break;
+
+        default:
+            putchar('(');
+            break;
+    }
 }
 
-void lval_expr_print(lval *v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
+static char lval_close(lval *v) {
+    switch (v->type) {
+        case LVAL_VEC:
+            return ']';
 
-    /* Print Value contained within */
-    lval_print(v->cell[i]);
+        case LVAL_MAP:
+        case LVAL_REC:
+            return '}';
+
+        default:
+            return ')';
+    }
+}
 
-    /* Don't print trailing space if last element */
-    if (i != (v->count-1)) {
+/*
+ * Print the elements of a list, vector, map or record and then close.
+ * Collections nested deeper than LvalMaxDepth are shown as "...".
+ */
+static void lval_nested_print(lval *v, char close) {
+  lval_stack s;
+  lval_stack_init(&s);
+  lval_stack_push(&s, v);
+
+  while (s.depth) {
+    lval_frame* f = &s.frames[s.depth - 1];
+    int i = f->i;
+    lval* x = lval_frame_next(f);
+    if (x == NULL) {
+      /* only the outermost collection uses the given bracket */
+      putchar(s.depth == 1 ? close : lval_close(f->v));
+      lval_stack_pop(&s);
+      continue;
+    }
+
+    /* Don't print a space before the first element */
+    if (i != 0) {
       putchar(' ');
     }
+    if (f->v->type == LVAL_REC) {
+      printf("%s ", f->v->rec->type->fields[i]);
+    }
+
+    /* Print Value contained within */
+    if (!lval_is_nested(x)) {
+      lval_print(x);
+    } else if (s.depth == LvalMaxDepth) {
+      printf("...");
+    } else {
+      lval_open_print(x);
+      lval_stack_push(&s, x);
+    }
   }
-  putchar(close);
+
+  lval_stack_free(&s);
+}
+
+void lval_expr_print(lval *v, char open, char close) {
+  putchar(open);
+  lval_nested_print(v, close);
+}
+
+/* shortest of %.15g and %.17g that reads back the same, always with a '.' */
+void lval_dbl_print(lval *v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", v->dbl);
+    if (strtod(buf, NULL) != v->dbl) {
+        snprintf(buf, sizeof(buf), "%.17g", v->dbl);
+    }
+    if (strpbrk(buf, ".en") == NULL) {
+        strcat(buf, ".0");
+    }
+    printf("%s", buf);
+}
+
+void lval_str_print(lval *v) {
+    size_t len = lstr_len(&v->str);
+    char *escaped = malloc(len + 1);
+    memcpy(escaped, lstr_cstr(&v->str), len + 1);
+    escaped = mpcf_escape(escaped);
+    printf("\"%s\"", escaped);
+    free(escaped);
 }
 
 void lval_print(lval *v) {
@@ -180,6 +945,10 @@ void lval_print(lval *v) {
 			printf("%li", v->num);
 			break;
 
+		case LVAL_DBL:
+			lval_dbl_print(v);
+			break;
+
 		case LVAL_ERR:
 			printf("Error: %s", v->err);
             break;
@@ -189,7 +958,19 @@ void lval_print(lval *v) {
             break;
 
 		case LVAL_SEXPR:
-            lval_expr_print(v, '(', ')');
+		case LVAL_VEC:
+		case LVAL_MAP:
+		case LVAL_REC:
+            lval_open_print(v);
+            lval_nested_print(v, lval_close(v));
+            break;
+
+		case LVAL_STR:
+            lval_str_print(v);
+            break;
+
+		case LVAL_SEQ:
+            lval_seq_print(v);
             break;
 	}
 }
@@ -289,13 +1070,13 @@ lval* eval_op(lval* x, char* op, lval* y) {
 /* NO LONGER USED */
 lval* eval(mpc_ast_t* t) {
     /* if tagged as number, return it directly */
-    if (strstr(t->tag, "number")) {
+    if (strstr(mpc_ast_get_tag(t), "number")) {
         errno = 0;
         long x = strtol(t->contents, NULL, 10);
         return errno != ERANGE ? lval_num(x) : lval_err("LERR_BAD_NUM");
     }
 
-    if (strstr(t->tag, "decimal")) {
+    if (strstr(mpc_ast_get_tag(t), "decimal")) {
         errno = 0;
         double x = strtod(t->contents, NULL);
         return errno != ERANGE ? lval_dbl(x) : lval_err("LERR_BAD_NUM");
@@ -306,7 +1087,7 @@ lval* eval(mpc_ast_t* t) {
 
     lval* x = eval(t->children[2]);
     int i = 3;
-    while (strstr(t->children[i]->tag, "expr")) {
+    while (strstr(mpc_ast_get_tag(t->children[i]), "expr")) {
         x = eval_op(x, op, eval(t->children[i]));
         i++;
     }
@@ -347,6 +1128,26 @@ char* lval_type(lval *v) {
             return "LVAL_SEXPR";
             break;
 
+        case LVAL_VEC:
+            return "LVAL_VEC";
+            break;
+
+        case LVAL_MAP:
+            return "LVAL_MAP";
+            break;
+
+        case LVAL_STR:
+            return "LVAL_STR";
+            break;
+
+        case LVAL_SEQ:
+            return "LVAL_SEQ";
+            break;
+
+        case LVAL_REC:
+            return "LVAL_REC";
+            break;
+
         default:
             return "NONE_TYPE";
             break;
@@ -354,23 +1155,35 @@ char* lval_type(lval *v) {
 }
 
 int parse_and_interpret(char* input) { 
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-
-        lval* x = lval_eval(lval_read(r.output));
-        lval_println(x);
-        lval_del(x);
-
-#ifdef DEBUG
-        /* On Success Print the AST */
-        mpc_ast_print(r.output);
+    size_t len = strlen(input);
+    lval* x = read_cache_get(ReadCache, input, len);
+    if (x != NULL) {
+        /* evaluation works on its input in place */
+        x = lval_copy(x);
+    } else {
+#ifndef MPC_READER
+        x = lval_read_buffer("<stdin>", input, len);
+        if (x->type == LVAL_ERR) {
+            /* syntax errors are already formatted like mpc's */
+            printf("%s", x->err);
+            lval_del(x);
+            return 0;
+        }
+#else
+        mpc_result_t r;
+        if (!mpc_parse("<stdin>", input, LvalLispy, &r)) {
+            /* same row and column as the hand reader, but mpc's own wording */
+            mpc_err_print(r.error);
+            mpc_err_delete(r.error);
+            return 0;
+        }
+        x = r.output;
 #endif
-        mpc_ast_delete(r.output);
-    } else {
-        /* Otherwise Print the Error */
-        mpc_err_print(r.error);
-        mpc_err_delete(r.error);
+        read_cache_put(ReadCache, input, len, x);
     }
+    x = lval_eval(x);
+    lval_println(x);
+    lval_del(x);
     return 0;
 }
 
@@ -392,18 +1205,96 @@ int shell() {
     return 0;
 }
 
+/* print a syntax error from the reader, which ends in a newline like mpc's */
+static void lval_syntax_println(lval* e) {
+    size_t n = strlen(e->err);
+    printf(n > 0 && e->err[n - 1] == '\n' ? "%s" : "%s\n", e->err);
+}
+
 int fromfile(char* filename) {
     printf("lispy: Reading from file %s\n", filename);
+    FILE* fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    if (fp == NULL) {
+        perror(filename);
+        return 1;
+    }
+
+    /* evaluate each top-level expression as soon as it has been read */
+    lval_stream* s = lval_stream_new(filename, fp);
+    lval* x;
+    while ((x = lval_stream_read(s))) {
+        if (lval_stream_error(s)) {
+            lval_syntax_println(x);
+            lval_del(x);
+            continue;
+        }
+        x = lval_eval(x);
+        lval_println(x);
+        lval_del(x);
+    }
+    lval_stream_delete(s);
+
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return 0;
+}
+
+/*
+ * Read the whole of filename on several threads, then evaluate its top
+ * level expressions in order. Faster than fromfile for large inputs, but
+ * holds all of it in memory at once.
+ */
+int fromfile_parallel(char* filename, int threads) {
+    printf("lispy: Reading from file %s on %d threads\n", filename, threads);
+    FILE* fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+    if (fp == NULL) {
+        perror(filename);
+        return 1;
+    }
+
+    /* grow the buffer as it fills, pipes cannot be sized up front */
+    size_t cap = 4096;
+    size_t len = 0;
+    size_t n;
+    char* input = malloc(cap);
+    while ((n = fread(input + len, 1, cap - len, fp)) > 0) {
+        len += n;
+        if (len == cap) {
+            cap *= 2;
+            input = realloc(input, cap);
+        }
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+
+    lval* all = lval_read_parallel(filename, input, len, threads);
+    free(input);
+    if (all->type == LVAL_ERR) {
+        lval_syntax_println(all);
+        lval_del(all);
+        return 0;
+    }
+
+    for (int i = 0; i < all->count; i++) {
+        lval* x = lval_eval(all->cell[i]);
+        lval_println(x);
+        lval_del(x);
+    }
+    all->count = 0;
+    lval_del(all);
     return 0;
 }
 
 //######################
-lval* lval_eval_sexpr(lval* v) {
+/* one of the arithmetic operators, the only symbols there were before vec */
+static int lval_is_op(const char* sym) {
+  return strlen(sym) == 1 && strchr("+-*/%", sym[0]);
+}
 
-  /* Evaluate Children */
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(v->cell[i]);
-  }
+/* apply an S-expression whose elements have all been evaluated */
+static lval* lval_eval_call(lval* v) {
 
   /* Error Checking */
   for (int i = 0; i < v->count; i++) {
@@ -413,8 +1304,13 @@ lval* lval_eval_sexpr(lval* v) {
   /* Empty Expression */
   if (v->count == 0) { return v; }
 
-  /* Single Expression */
-  if (v->count == 1) { return lval_take(v, 0); }
+  /*
+   * Single Expression, unless it names a function that can take no
+   * arguments, so (vec) is an empty vector while (+) is still just +
+   */
+  if (v->count == 1 && (v->cell[0]->type != LVAL_SYM || lval_is_op(v->cell[0]->sym))) {
+    return lval_take(v, 0);
+  }
 
   /* Ensure First Element is Symbol */
   lval* f = lval_pop(v, 0);
@@ -424,16 +1320,46 @@ lval* lval_eval_sexpr(lval* v) {
   }
 
   /* Call builtin with operator */
-  lval* result = builtin_op(v, f->sym);
+  lval* result = builtin(v, f->sym);
   lval_del(f);
   return result;
 }
 
 lval* lval_eval(lval* v) {
-  /* Evaluate Sexpressions */
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(v); }
-  /* All other lval types remain the same */
-  return v;
+  /* All lval types but Sexpressions remain the same */
+  if (v->type != LVAL_SEXPR) { return v; }
+
+  lval_stack s;
+  lval_stack_init(&s);
+  lval_stack_push(&s, v);
+
+  while (1) {
+    lval_frame* f = &s.frames[s.depth - 1];
+
+    /* Evaluate Children, each replacing itself in its list */
+    if (f->i < f->v->count) {
+      lval* x = f->v->cell[f->i];
+      if (x->type != LVAL_SEXPR) {
+        f->i++;
+      } else if (s.depth == LvalMaxDepth) {
+        /* every list on the stack is still held by the one below it */
+        lval_stack_free(&s);
+        lval_del(v);
+        return lval_err("Expression nested too deeply!");
+      } else {
+        lval_stack_push(&s, x);
+      }
+      continue;
+    }
+
+    lval* result = lval_eval_call(f->v);
+    if (--s.depth == 0) {
+      lval_stack_free(&s);
+      return result;
+    }
+    f = &s.frames[s.depth - 1];
+    f->v->cell[f->i++] = result;
+  }
 }
 
 lval* lval_pop(lval* v, int i) {
@@ -461,6 +1387,8 @@ lval* lval_take(lval* v, int i) {
 
 lval* builtin_op(lval* a, char* op) {
 
+  LASSERT(a, a->count > 0, "Function passed no arguments!");
+
   /* Ensure all arguments are numbers */
   for (int i = 0; i < a->count; i++) {
     if (a->cell[i]->type != LVAL_NUM) {
@@ -528,34 +1456,774 @@ lval* builtin_op(lval* a, char* op) {
   return x;
 }
 
+lval* builtin_vec(lval* a) {
+    rrb_t* t = rrb_new(lval_retain, lval_release);
+    for (int i = 0; i < a->count; ++i) {
+        rrb_t* next = rrb_push(t, a->cell[i]);
+        rrb_delete(t);
+        t = next;
+    }
+    a->count = 0;
+    lval_del(a);
+    return lval_vec(t);
+}
+
+lval* builtin_count(lval* a) {
+    LASSERT(a, a->count == 1, "Function 'count' passed too many arguments!");
+    lval* x;
+    switch (a->cell[0]->type) {
+        case LVAL_VEC:
+            x = lval_num((long)rrb_count(a->cell[0]->vec));
+            break;
+
+        case LVAL_MAP:
+            x = lval_num((long)hamt_count(a->cell[0]->map));
+            break;
+
+        case LVAL_STR:
+            x = lval_num((long)lstr_len(&a->cell[0]->str));
+            break;
+
+        case LVAL_SEQ:
+            x = lseq_count(a->cell[0]->seq);
+            break;
+
+        default:
+            x = lval_err("Function 'count' passed incorrect type!");
+            break;
+    }
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_nth(lval* a) {
+    LASSERT(a, a->count == 2, "Function 'nth' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_VEC, "Function 'nth' passed incorrect type!");
+    LASSERT(a, a->cell[1]->type == LVAL_NUM, "Function 'nth' passed incorrect type!");
+
+    rrb_t* t = a->cell[0]->vec;
+    long i = a->cell[1]->num;
+    LASSERT(a, i >= 0 && (size_t)i < rrb_count(t), "Function 'nth' index out of range!");
+
+    lval* x = lval_copy(rrb_nth(t, (size_t)i));
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_conj(lval* a) {
+    LASSERT(a, a->count >= 1, "Function 'conj' passed no arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_VEC, "Function 'conj' passed incorrect type!");
+
+    lval* v = lval_pop(a, 0);
+    for (int i = 0; i < a->count; ++i) {
+        rrb_t* next = rrb_push(v->vec, a->cell[i]);
+        rrb_delete(v->vec);
+        v->vec = next;
+    }
+    a->count = 0;
+    lval_del(a);
+    return v;
+}
+
+lval* builtin_pop(lval* a) {
+    LASSERT(a, a->count == 1, "Function 'pop' passed too many arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_VEC, "Function 'pop' passed incorrect type!");
+    LASSERT(a, rrb_count(a->cell[0]->vec) > 0, "Function 'pop' passed empty vector!");
+
+    lval* x = lval_vec(rrb_pop(a->cell[0]->vec));
+    lval_del(a);
+    return x;
+}
+
+/*
+ * Insert the key/value pairs in a, starting at cell `first`, into t. All
+ * the pairs go through a single hamt_build, so each trie node on the way
+ * is copied at most once per call rather than once per pair.
+ */
+static hamt_t* map_build(hamt_t* t, lval* a, int first) {
+    size_t n = (size_t)(a->count - first) / 2;
+    void** keys = malloc(sizeof(void*) * n);
+    void** vals = malloc(sizeof(void*) * n);
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = a->cell[first + 2 * i];
+        vals[i] = a->cell[first + 2 * i + 1];
+    }
+    hamt_t* r = hamt_build(t, n, keys, vals);
+    free(keys);
+    free(vals);
+
+    /* the map now owns the pairs */
+    a->count = first;
+    return r;
+}
+
+static lval* builtin_map_assoc(lval* a) {
+    LASSERT(a, a->count % 2 == 1, "Function 'assoc' passed a key without a value!");
+    lval* x = lval_map(map_build(a->cell[0]->map, a, 1));
+    lval_del(a);
+    return x;
+}
+
+static int lrec_slot(lrec_type* t, char* field) {
+    for (int i = 0; i < t->count; ++i) {
+        if (strcmp(t->fields[i], field) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* (assoc rec field value ...) with the fields named by symbols */
+static lval* builtin_rec_assoc(lval* a) {
+    LASSERT(a, a->count % 2 == 1, "Function 'assoc' passed a field without a value!");
+    lrec_type* t = a->cell[0]->rec->type;
+    for (int i = 1; i < a->count; i += 2) {
+        LASSERT(a, a->cell[i]->type == LVAL_SYM, "Function 'assoc' passed incorrect type!");
+        LASSERT(a, lrec_slot(t, a->cell[i]->sym) >= 0,
+                "Function 'assoc' passed a field the record does not have!");
+    }
+
+    /* the record is ours, so its slots can be replaced in place */
+    lval* r = lval_pop(a, 0);
+    for (int i = 0; i + 1 < a->count; i += 2) {
+        int slot = lrec_slot(t, a->cell[i]->sym);
+        lval_del(r->rec->slots[slot]);
+        r->rec->slots[slot] = lval_retain(a->cell[i + 1]);
+    }
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_assoc(lval* a) {
+    LASSERT(a, a->count >= 1, "Function 'assoc' passed no arguments!");
+    if (a->cell[0]->type == LVAL_MAP) {
+        return builtin_map_assoc(a);
+    }
+    if (a->cell[0]->type == LVAL_REC) {
+        return builtin_rec_assoc(a);
+    }
+    LASSERT(a, a->count == 3, "Function 'assoc' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_VEC, "Function 'assoc' passed incorrect type!");
+    LASSERT(a, a->cell[1]->type == LVAL_NUM, "Function 'assoc' passed incorrect type!");
+
+    rrb_t* t = a->cell[0]->vec;
+    long i = a->cell[1]->num;
+    LASSERT(a, i >= 0 && (size_t)i < rrb_count(t), "Function 'assoc' index out of range!");
+
+    lval* x = lval_vec(rrb_update(t, (size_t)i, lval_pop(a, 2)));
+    lval_del(a);
+    return x;
+}
+
+/*
+ * Strings are joined into a rope, so building up a long string one piece
+ * at a time costs O(1) per piece rather than copying everything so far.
+ */
+static lval* builtin_str_concat(lval* a) {
+    for (int i = 0; i < a->count; ++i) {
+        LASSERT(a, a->cell[i]->type == LVAL_STR, "Function 'concat' passed incorrect type!");
+    }
+
+    lval* v = lval_pop(a, 0);
+    for (int i = 0; i < a->count; ++i) {
+        lstr_t next = lstr_concat(&v->str, &a->cell[i]->str);
+        lstr_delete(&v->str);
+        v->str = next;
+    }
+    lval_del(a);
+    return v;
+}
+
+lval* builtin_concat(lval* a) {
+    LASSERT(a, a->count >= 1, "Function 'concat' passed no arguments!");
+    if (a->cell[0]->type == LVAL_STR) {
+        return builtin_str_concat(a);
+    }
+    for (int i = 0; i < a->count; ++i) {
+        LASSERT(a, a->cell[i]->type == LVAL_VEC, "Function 'concat' passed incorrect type!");
+    }
+
+    lval* v = lval_pop(a, 0);
+    for (int i = 0; i < a->count; ++i) {
+        rrb_t* next = rrb_concat(v->vec, a->cell[i]->vec);
+        rrb_delete(v->vec);
+        v->vec = next;
+    }
+    lval_del(a);
+    return v;
+}
+
+lval* builtin_slice(lval* a) {
+    LASSERT(a, a->count == 3, "Function 'slice' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_VEC, "Function 'slice' passed incorrect type!");
+    LASSERT(a, a->cell[1]->type == LVAL_NUM, "Function 'slice' passed incorrect type!");
+    LASSERT(a, a->cell[2]->type == LVAL_NUM, "Function 'slice' passed incorrect type!");
+
+    rrb_t* t = a->cell[0]->vec;
+    long from = a->cell[1]->num;
+    long to = a->cell[2]->num;
+    LASSERT(a, from >= 0 && from <= to && (size_t)to <= rrb_count(t),
+            "Function 'slice' index out of range!");
+
+    lval* x = lval_vec(rrb_slice(t, (size_t)from, (size_t)to));
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_hash_map(lval* a) {
+    LASSERT(a, a->count % 2 == 0, "Function 'hash-map' passed a key without a value!");
+    hamt_t* t = hamt_new(lval_hash, lval_eq, lval_retain, lval_release);
+    lval* x = lval_map(map_build(t, a, 0));
+    hamt_delete(t);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_get(lval* a) {
+    LASSERT(a, a->count == 2 || a->count == 3,
+            "Function 'get' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_MAP, "Function 'get' passed incorrect type!");
+
+    lval* v = hamt_get(a->cell[0]->map, a->cell[1]);
+    if (v == NULL) {
+        /* fall back to the default when one is given */
+        LASSERT(a, a->count == 3, "Function 'get' key not found!");
+        return lval_take(a, 2);
+    }
+
+    lval* x = lval_copy(v);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_dissoc(lval* a) {
+    LASSERT(a, a->count >= 1, "Function 'dissoc' passed no arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_MAP, "Function 'dissoc' passed incorrect type!");
+
+    lval* m = lval_pop(a, 0);
+    for (int i = 0; i < a->count; ++i) {
+        hamt_t* next = hamt_dissoc(m->map, a->cell[i]);
+        hamt_delete(m->map);
+        m->map = next;
+    }
+    lval_del(a);
+    return m;
+}
+
+/*
+ * Lazy sequences
+ *
+ * range, map, filter and take only record what to do. Consuming the
+ * sequence (reduce, count or printing it) pulls each element from the
+ * source through every stage before the next one is produced, so a whole
+ * pipeline runs as one loop and never builds an intermediate list.
+ */
+
+/* f is a builtin symbol, or a vector (vec f args...) called as (f x args...) */
+static int lval_callable(lval* f) {
+    if (f->type == LVAL_SYM) {
+        return 1;
+    }
+    return f->type == LVAL_VEC && rrb_count(f->vec) > 0
+        && ((lval*)rrb_nth(f->vec, 0))->type == LVAL_SYM;
+}
+
+static lval* lval_call(lval* f, lval* a) {
+    if (f->type == LVAL_SYM) {
+        return builtin(a, f->sym);
+    }
+    for (size_t i = 1; i < rrb_count(f->vec); ++i) {
+        lval_add(a, lval_copy(rrb_nth(f->vec, i)));
+    }
+    return builtin(a, ((lval*)rrb_nth(f->vec, 0))->sym);
+}
+
+static int lval_truthy(lval* x) {
+    return x->type != LVAL_NUM || x->num != 0;
+}
+
+/* receives each element of a sequence, returns non-NULL to stop */
+typedef lval* (*lseq_sink_t)(lval* x, void* d);
+
+/*
+ * Run every element of s through its stages and hand the survivors to
+ * sink. Returns NULL once the sequence is exhausted, otherwise the error
+ * raised by a stage or whatever the sink stopped with.
+ */
+static lval* lseq_run(lseq* s, lseq_sink_t sink, void* d) {
+    /* ranges are counted and stepped in unsigned long so wide ones can't overflow */
+    unsigned long start = (unsigned long)s->start;
+    unsigned long end = (unsigned long)s->end;
+    unsigned long step = (unsigned long)s->step;
+    size_t total;
+    if (s->src) {
+        total = rrb_count(s->src->vec);
+    } else if (s->step > 0) {
+        total = s->end > s->start ? (size_t)((end - start - 1) / step + 1) : 0;
+    } else {
+        total = s->start > s->end ? (size_t)((start - end - 1) / (0UL - step) + 1) : 0;
+    }
+
+    long* taken = calloc(s->count, sizeof(long));
+    lval** chunk = NULL;
+    size_t len = 0;
+    size_t pos = 0;
+    lval* result = NULL;
+    int done = 0;
+
+    for (size_t k = 0; k < total && result == NULL && !done; ++k) {
+        lval* x;
+        if (s->src) {
+            if (pos == len) {
+                chunk = (lval**)rrb_chunk(s->src->vec, k, &len);
+                pos = 0;
+            }
+            x = lval_copy(chunk[pos++]);
+        } else {
+            x = lval_num((long)(start + (unsigned long)k * step));
+        }
+
+        for (int j = 0; x != NULL && j < s->count; ++j) {
+            lseq_stage* st = &s->stages[j];
+            lval* a;
+            lval* r;
+            switch (st->kind) {
+                case LSEQ_MAP:
+                    a = lval_add(lval_sexpr(), x);
+                    x = lval_call(st->f, a);
+                    if (x->type == LVAL_ERR) {
+                        result = x;
+                        x = NULL;
+                    }
+                    break;
+
+                case LSEQ_FILTER:
+                    a = lval_add(lval_sexpr(), lval_copy(x));
+                    r = lval_call(st->f, a);
+                    if (r->type == LVAL_ERR || !lval_truthy(r)) {
+                        lval_del(x);
+                        x = NULL;
+                    }
+                    if (r->type == LVAL_ERR) {
+                        result = r;
+                    } else {
+                        lval_del(r);
+                    }
+                    break;
+
+                case LSEQ_TAKE:
+                    if (taken[j] == st->n) {
+                        lval_del(x);
+                        x = NULL;
+                        done = 1;
+                        break;
+                    }
+                    /* nothing past this stage can use another element */
+                    if (++taken[j] == st->n) {
+                        done = 1;
+                    }
+                    break;
+            }
+        }
+
+        if (x != NULL) {
+            result = sink(x, d);
+        }
+    }
+
+    free(taken);
+    return result;
+}
+
+static lval* lseq_print_sink(lval* x, void* d) {
+    int* first = d;
+    if (!*first) {
+        putchar(' ');
+    }
+    *first = 0;
+    lval_print(x);
+    lval_del(x);
+    return NULL;
+}
+
+void lval_seq_print(lval *v) {
+    int first = 1;
+    putchar('(');
+    lval* err = lseq_run(v->seq, lseq_print_sink, &first);
+    putchar(')');
+    if (err) {
+        putchar(' ');
+        lval_print(err);
+        lval_del(err);
+    }
+}
+
+static lval* lseq_count_sink(lval* x, void* d) {
+    ++*(long*)d;
+    lval_del(x);
+    return NULL;
+}
+
+static lval* lseq_count(lseq* s) {
+    long n = 0;
+    lval* err = lseq_run(s, lseq_count_sink, &n);
+    return err ? err : lval_num(n);
+}
+
+static lval* lseq_list_sink(lval* x, void* d) {
+    lval_add(d, x);
+    return NULL;
+}
+
+/* everything s yields as a list, ending with the error if a stage raised one */
+static lval* lseq_list(lseq* s) {
+    lval* l = lval_sexpr();
+    lval* err = lseq_run(s, lseq_list_sink, l);
+    return err ? lval_add(l, err) : l;
+}
+
+/* the sequence to add a stage to, taking ownership of v */
+static lval* lval_to_seq(lval* v) {
+    if (v->type == LVAL_SEQ) {
+        return v;
+    }
+    return lval_seq(lseq_new(v, 0, 0, 1));
+}
+
+lval* builtin_range(lval* a) {
+    LASSERT(a, a->count >= 1 && a->count <= 3,
+            "Function 'range' passed incorrect number of arguments!");
+    for (int i = 0; i < a->count; ++i) {
+        LASSERT(a, a->cell[i]->type == LVAL_NUM, "Function 'range' passed incorrect type!");
+    }
+
+    long start = a->count > 1 ? a->cell[0]->num : 0;
+    long end = a->count > 1 ? a->cell[1]->num : a->cell[0]->num;
+    long step = a->count > 2 ? a->cell[2]->num : 1;
+    LASSERT(a, step != 0, "Function 'range' passed a step of zero!");
+
+    lval_del(a);
+    return lval_seq(lseq_new(NULL, start, end, step));
+}
+
+/* add a map or filter stage to the sequence in a, after checking a */
+static lval* lseq_stage_push(lval* a, int kind) {
+    lval* f = lval_pop(a, 0);
+    lval* s = lval_to_seq(lval_take(a, 0));
+    lseq_push(s->seq, kind, f, 0);
+    return s;
+}
+
+lval* builtin_map(lval* a) {
+    LASSERT(a, a->count == 2, "Function 'map' passed incorrect number of arguments!");
+    LASSERT(a, lval_callable(a->cell[0]), "Function 'map' passed something that is not a function!");
+    LASSERT(a, a->cell[1]->type == LVAL_SEQ || a->cell[1]->type == LVAL_VEC,
+            "Function 'map' passed incorrect type!");
+    return lseq_stage_push(a, LSEQ_MAP);
+}
+
+lval* builtin_filter(lval* a) {
+    LASSERT(a, a->count == 2, "Function 'filter' passed incorrect number of arguments!");
+    LASSERT(a, lval_callable(a->cell[0]), "Function 'filter' passed something that is not a function!");
+    LASSERT(a, a->cell[1]->type == LVAL_SEQ || a->cell[1]->type == LVAL_VEC,
+            "Function 'filter' passed incorrect type!");
+    return lseq_stage_push(a, LSEQ_FILTER);
+}
+
+lval* builtin_take(lval* a) {
+    LASSERT(a, a->count == 2, "Function 'take' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_NUM, "Function 'take' passed incorrect type!");
+    LASSERT(a, a->cell[0]->num >= 0, "Function 'take' passed a negative count!");
+    LASSERT(a, a->cell[1]->type == LVAL_SEQ || a->cell[1]->type == LVAL_VEC,
+            "Function 'take' passed incorrect type!");
+
+    long n = a->cell[0]->num;
+    lval* s = lval_to_seq(lval_take(a, 1));
+    lseq_push(s->seq, LSEQ_TAKE, NULL, n);
+    return s;
+}
+
+typedef struct {
+    lval* f;
+    lval* acc;
+} lseq_reduce_t;
+
+static lval* lseq_reduce_sink(lval* x, void* d) {
+    lseq_reduce_t* r = d;
+    if (r->acc == NULL) {
+        r->acc = x;
+        return NULL;
+    }
+
+    lval* a = lval_add(lval_add(lval_sexpr(), r->acc), x);
+    r->acc = lval_call(r->f, a);
+    if (r->acc->type == LVAL_ERR) {
+        lval* err = r->acc;
+        r->acc = NULL;
+        return err;
+    }
+    return NULL;
+}
+
+/* (reduce f coll) or (reduce f init coll) */
+lval* builtin_reduce(lval* a) {
+    LASSERT(a, a->count == 2 || a->count == 3,
+            "Function 'reduce' passed incorrect number of arguments!");
+    LASSERT(a, lval_callable(a->cell[0]), "Function 'reduce' passed something that is not a function!");
+    LASSERT(a, a->cell[a->count - 1]->type == LVAL_SEQ || a->cell[a->count - 1]->type == LVAL_VEC,
+            "Function 'reduce' passed incorrect type!");
+
+    lseq_reduce_t r;
+    r.f = lval_pop(a, 0);
+    r.acc = a->count == 2 ? lval_pop(a, 0) : NULL;
+    lval* s = lval_to_seq(lval_take(a, 0));
+
+    lval* err = lseq_run(s->seq, lseq_reduce_sink, &r);
+    lval_del(s);
+    lval_del(r.f);
+    if (err) {
+        if (r.acc) {
+            lval_del(r.acc);
+        }
+        return err;
+    }
+    return r.acc ? r.acc : lval_err("Function 'reduce' passed an empty sequence!");
+}
+
+/*
+ * Records
+ *
+ * defrecord binds a constructor and one accessor per field. Each accessor
+ * already knows the slot index of its field, so reading a field costs a
+ * single name lookup plus an array index, however many fields there are.
+ */
+
+static uint32_t lrec_fn_hash(void* x) {
+    char* name = ((lrec_fn*)x)->name;
+    return hash_bytes(2166136261u, name, strlen(name));
+}
+
+static int lrec_fn_eq(void* x, void* y) {
+    return strcmp(((lrec_fn*)x)->name, ((lrec_fn*)y)->name) == 0;
+}
+
+static void* lrec_fn_retain(void* x) {
+    ((lrec_fn*)x)->refs++;
+    return x;
+}
+
+static void lrec_fn_release(void* x) {
+    lrec_fn* f = x;
+    if (--f->refs > 0) {
+        return;
+    }
+    lrec_type_release(f->type);
+    free(f->name);
+    free(f);
+}
+
+/* bind name to the constructor (slot -1) or a field accessor of t */
+static void lrec_bind(char* name, lrec_type* t, int slot) {
+    static unsigned long versions;
+    lrec_fn* f = malloc(sizeof(lrec_fn));
+    f->refs = 1;
+    f->name = str_dup(name);
+    f->type = t;
+    f->slot = slot;
+    t->refs++;
+
+    if (Records == NULL) {
+        Records = hamt_new(lrec_fn_hash, lrec_fn_eq, lrec_fn_retain, lrec_fn_release);
+    }
+    /* the function is both the key and the value */
+    hamt_t* next = hamt_assoc(Records, lrec_fn_retain(f), f);
+    hamt_delete(Records);
+    Records = next;
+    RecordsVersion = ++versions;
+}
+
+/* (defrecord name field ...) */
+/* builtins called by name, tried before the operators and records */
+static const struct {
+    const char* name;
+    lval* (*fn)(lval*);
+} Builtins[] = {
+    { "vec",         builtin_vec },
+    { "count",       builtin_count },
+    { "nth",         builtin_nth },
+    { "conj",        builtin_conj },
+    { "pop",         builtin_pop },
+    { "assoc",       builtin_assoc },
+    { "concat",      builtin_concat },
+    { "slice",       builtin_slice },
+    { "hash-map",    builtin_hash_map },
+    { "get",         builtin_get },
+    { "dissoc",      builtin_dissoc },
+    { "range",       builtin_range },
+    { "map",         builtin_map },
+    { "filter",      builtin_filter },
+    { "take",        builtin_take },
+    { "reduce",      builtin_reduce },
+    { "defrecord",   builtin_defrecord },
+    { "cache-stats", builtin_cache_stats },
+    { "cache-budget", builtin_cache_budget },
+};
+
+#define NUM_BUILTINS (sizeof(Builtins) / sizeof(Builtins[0]))
+
+/* whether a call to sym would never reach a record bound to it */
+static int lval_is_builtin(const char* sym) {
+    for (size_t i = 0; i < NUM_BUILTINS; ++i) {
+        if (strcmp(Builtins[i].name, sym) == 0) {
+            return 1;
+        }
+    }
+    return lval_is_op(sym);
+}
+
+/* name of the accessor defrecord binds for a field */
+static char* lrec_accessor_name(const char* rec, const char* field) {
+    char* name = malloc(strlen(rec) + strlen(field) + 2);
+    sprintf(name, "%s-%s", rec, field);
+    return name;
+}
+
+lval* builtin_defrecord(lval* a) {
+    LASSERT(a, a->count >= 1, "Function 'defrecord' passed no arguments!");
+    for (int i = 0; i < a->count; ++i) {
+        LASSERT(a, a->cell[i]->type == LVAL_SYM, "Function 'defrecord' passed incorrect type!");
+        for (int j = 1; j < i; ++j) {
+            LASSERT(a, strcmp(a->cell[i]->sym, a->cell[j]->sym) != 0,
+                    "Function 'defrecord' passed the same field twice!");
+        }
+    }
+    LASSERT(a, !lval_is_builtin(a->cell[0]->sym),
+            "Function 'defrecord' passed the name of a builtin!");
+    for (int i = 1; i < a->count; ++i) {
+        char* name = lrec_accessor_name(a->cell[0]->sym, a->cell[i]->sym);
+        int shadowed = lval_is_builtin(name);
+        free(name);
+        LASSERT(a, !shadowed, "Function 'defrecord' passed a field whose accessor is a builtin!");
+    }
+
+    lrec_type* t = malloc(sizeof(lrec_type));
+    t->refs = 1;
+    t->name = str_dup(a->cell[0]->sym);
+    t->count = a->count - 1;
+    t->fields = malloc(sizeof(char*) * t->count);
+    for (int i = 0; i < t->count; ++i) {
+        t->fields[i] = str_dup(a->cell[i + 1]->sym);
+    }
+
+    lrec_bind(t->name, t, -1);
+    for (int i = 0; i < t->count; ++i) {
+        char* name = lrec_accessor_name(t->name, t->fields[i]);
+        lrec_bind(name, t, i);
+        free(name);
+    }
+    lrec_type_release(t);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/* call the record constructor or accessor named func */
+lval* builtin_record(lval* a, char* func) {
+    lrec_fn key;
+    key.name = func;
+    lrec_fn* f = Records ? hamt_get(Records, &key) : NULL;
+    if (f == NULL) {
+        lval_del(a);
+        return lval_err("Unknown Function!");
+    }
+
+    if (f->slot < 0) {
+        LASSERT(a, a->count == f->type->count,
+                "Record constructor passed incorrect number of arguments!");
+        lval* r = lval_rec(f->type);
+        for (int i = 0; i < a->count; ++i) {
+            r->rec->slots[i] = a->cell[i];
+        }
+        a->count = 0;
+        lval_del(a);
+        return r;
+    }
+
+    LASSERT(a, a->count == 1, "Record accessor passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_REC && a->cell[0]->rec->type == f->type,
+            "Record accessor passed incorrect type!");
+    lval* x = lval_copy(a->cell[0]->rec->slots[f->slot]);
+    lval_del(a);
+    return x;
+}
+
+static void cache_stat(lval* a, const char* name, size_t n) {
+    lval_add(a, lval_str(lstr_new(name, strlen(name))));
+    lval_add(a, lval_num((long)n));
+}
+
+/* hit and miss counts of the read cache, as a map */
+lval* builtin_cache_stats(lval* a) {
+    LASSERT(a, a->count == 0, "Function 'cache-stats' passed too many arguments!");
+    read_cache_stats st = read_cache_get_stats(ReadCache);
+    cache_stat(a, "hits", st.hits);
+    cache_stat(a, "misses", st.misses);
+    cache_stat(a, "evictions", st.evictions);
+    cache_stat(a, "entries", st.entries);
+    cache_stat(a, "bytes", st.bytes);
+    cache_stat(a, "budget", st.budget);
+    return builtin_hash_map(a);
+}
+
+/* set how many bytes the read cache may hold, evicting to fit */
+lval* builtin_cache_budget(lval* a) {
+    LASSERT(a, a->count == 1, "Function 'cache-budget' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_NUM, "Function 'cache-budget' passed incorrect type!");
+    LASSERT(a, a->cell[0]->num >= 0, "Function 'cache-budget' passed a negative budget!");
+    read_cache_set_budget(ReadCache, (size_t)a->cell[0]->num);
+    return lval_take(a, 0);
+}
+
+lval* builtin(lval* a, char* func) {
+    for (size_t i = 0; i < NUM_BUILTINS; ++i) {
+        if (strcmp(Builtins[i].name, func) == 0) { return Builtins[i].fn(a); }
+    }
+    if (lval_is_op(func)) { return builtin_op(a, func); }
+    return builtin_record(a, func);
+}
+
 //######################
 
+/* READ_CACHE_BUDGET, unless LISPY_READ_CACHE_BUDGET gives a byte count */
+static size_t read_cache_budget(void) {
+    const char* s = getenv("LISPY_READ_CACHE_BUDGET");
+    if (s == NULL) {
+        return READ_CACHE_BUDGET;
+    }
+    char* end;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (*s < '0' || *s > '9' || *end != '\0') {
+        fprintf(stderr, "lispy: ignoring LISPY_READ_CACHE_BUDGET=%s, not a byte count\n", s);
+        return READ_CACHE_BUDGET;
+    }
+    return (size_t)n;
+}
+
 int run(int argc, char** argv) {
-    /* Global parsers */
-    Number   = mpc_new("number");
-    Decimal  = mpc_new("decimal");
-    Sexpr    = mpc_new("sexpr");
-    Symbol   = mpc_new("symbol");
-    Expr     = mpc_new("expr");
-    Lispy    = mpc_new("lispy");
-
-    /* Define them with the following Language */
-    mpca_lang(MPCA_LANG_DEFAULT,
-    "                                                       \
-      number  : /-?[0-9]+/ ;                                \
-      decimal : /-?[0-9]+\\.[0-9]+/ ;                       \
-      sexpr   : '(' <expr>* ')' ;                           \
-      symbol  : '+' | '-' | '*' | '/' | '%';                \
-      expr    : <number> | <decimal> | <symbol> | <sexpr> ; \
-      lispy   : /^/ <expr>* /$/ ;                           \
-    ",
-        Number, Decimal, Sexpr, Symbol, Expr, Lispy);
+    ReadCache = read_cache_new(read_cache_budget());
+
+#ifdef MPC_READER
+    lval_parser_new();
+#endif
 
     int reti;
 
     printf("argc = %d\n", argc);
     if (argc == 2) {
         reti = fromfile(argv[1]);
+    } else if (argc == 4 && strcmp(argv[1], "-j") == 0) {
+        reti = fromfile_parallel(argv[3], atoi(argv[2]));
+    } else if (argc == 3 && strcmp(argv[1], "-w") == 0) {
+        reti = watch_file(argv[2]);
     } else {
         reti = shell();
     }
@@ -566,7 +2234,12 @@ int run(int argc, char** argv) {
 int main(int argc, char** argv) {
     int reti = run(argc, argv);
 
-    /* Undefine and Delete our Parsers */
-    mpc_cleanup(NUM_PARSERS, Number, Decimal, Sexpr, Symbol, Expr, Lispy);
+#ifdef MPC_READER
+    mpc_cleanup(2, LvalExpr, LvalLispy);
+#endif
+    if (Records) {
+        hamt_delete(Records);
+    }
+    read_cache_delete(ReadCache);
     return 0;
 }
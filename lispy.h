@@ -1,26 +1,102 @@
 #ifndef LISPY_H
 #define LISPY_H
 
+/*
+ * Deepest nesting of S-expressions that reading and evaluation accept,
+ * counting the outermost list. Deeper input gives an LVAL_ERR rather
+ * than exhausting the stack, since none of them recurse per level.
+ */
+#define LVAL_MAX_DEPTH 1000000
+extern int LvalMaxDepth;
+
+/*
+ * Record functions bound by defrecord. RecordsVersion identifies the
+ * contents of Records, so anything computed under one version can be
+ * reused while Records is back at that version.
+ */
+extern hamt_t* Records;
+extern unsigned long RecordsVersion;
+
 /* lisp value */
 typedef struct lval {
     int type;
     int count;
+    int refs;
     union {
         long          num;
         double        dbl;
         char         *err;
         char         *sym;
         struct lval **cell;
+        rrb_t        *vec;
+        hamt_t       *map;
+        lstr_t        str;
+        struct lseq  *seq;
+        struct lrec  *rec;
     };
 } lval;
 
+/* record type created by defrecord */
+typedef struct lrec_type {
+    int refs;
+    char *name;
+    int count;
+    char **fields;
+} lrec_type;
+
+/* record instance, holding one slot per field of its type */
+typedef struct lrec {
+    lrec_type *type;
+    lval *slots[];
+} lrec;
+
+/* record constructor (slot -1) or field accessor, bound by defrecord */
+typedef struct lrec_fn {
+    int refs;
+    char *name;
+    lrec_type *type;
+    int slot;
+} lrec_fn;
+
+/* lazy sequence stage kinds */
+typedef enum {
+    LSEQ_MAP,
+    LSEQ_FILTER,
+    LSEQ_TAKE
+} LSEQ_KIND;
+
+typedef struct lseq_stage {
+    int kind;
+    lval *f;    /* function for map and filter */
+    long n;     /* limit for take */
+} lseq_stage;
+
+/*
+ * Lazy sequence: a source (a range, or a vector when src is not NULL)
+ * followed by a pipeline of stages that are run together, one element at
+ * a time, only when the sequence is consumed.
+ */
+typedef struct lseq {
+    lval *src;
+    long start;
+    long end;
+    long step;
+    int count;
+    lseq_stage *stages;
+} lseq;
+
 /* lval types */
 typedef enum {
     LVAL_NUM,
     LVAL_DBL,
     LVAL_ERR,
     LVAL_SYM,
-    LVAL_SEXPR
+    LVAL_SEXPR,
+    LVAL_VEC,
+    LVAL_MAP,
+    LVAL_STR,
+    LVAL_SEQ,
+    LVAL_REC
 } LVAL_TYPE;
 
 /* error types */
@@ -37,13 +113,21 @@ lval* lval_dbl(double x);
 //lval* lval_err(int x);
 lval* lval_err(char* m);
 lval* lval_sym(char *s);
+lval* lval_sym_n(const char *s, size_t n);
 lval* lval_sexpr(void);
+lval* lval_vec(rrb_t *t);
+lval* lval_map(hamt_t *t);
+lval* lval_str(lstr_t s);
+lval* lval_seq(lseq *s);
+lval* lval_rec(lrec_type *t);
+lval* lval_copy(lval *v);
 int destroy_lval(lval* v);
 int lval_del(lval *v);
-lval* lval_read_num(mpc_ast_t *t);
 lval* lval_add(lval *v, lval *x);
-lval* lval_read(mpc_ast_t *t);
 void lval_expr_print(lval *v, char open, char close);
+void lval_dbl_print(lval *v);
+void lval_str_print(lval *v);
+void lval_seq_print(lval *v);
 void lval_print(lval *v);
 void lval_println(lval *v);
 int number_of_nodes(mpc_ast_t* t);
@@ -53,10 +137,32 @@ int display_greeting();
 int parse_and_interpret(char* input);
 int shell();
 int fromfile(char* filename);
+int fromfile_parallel(char* filename, int threads);
 int run(int argc, char** argv);
 lval* lval_eval(lval *v);
 lval* lval_pop(lval *v, int i);
 lval* lval_take(lval *v, int i);
 lval* builtin_op(lval *a, char *op);
+lval* builtin(lval *a, char *func);
+lval* builtin_vec(lval *a);
+lval* builtin_count(lval *a);
+lval* builtin_nth(lval *a);
+lval* builtin_conj(lval *a);
+lval* builtin_pop(lval *a);
+lval* builtin_assoc(lval *a);
+lval* builtin_concat(lval *a);
+lval* builtin_slice(lval *a);
+lval* builtin_hash_map(lval *a);
+lval* builtin_get(lval *a);
+lval* builtin_dissoc(lval *a);
+lval* builtin_range(lval *a);
+lval* builtin_map(lval *a);
+lval* builtin_filter(lval *a);
+lval* builtin_take(lval *a);
+lval* builtin_reduce(lval *a);
+lval* builtin_defrecord(lval *a);
+lval* builtin_record(lval *a, char *func);
+lval* builtin_cache_stats(lval *a);
+lval* builtin_cache_budget(lval *a);
 
 #endif /* LISPY_H */
@@ -0,0 +1,32 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Number literal parsing.
+ *
+ * Converts the text matched by the number and decimal rules without going
+ * through strtol or strtod, which consult the locale and re-scan the
+ * input for signs, bases and exponents the grammar never allows.
+ */
+
+#ifndef LNUM_H
+#define LNUM_H
+
+#include <stddef.h>
+
+/*
+ * Parse -?[0-9]+ from the n bytes at s into *x. Returns 0, leaving *x
+ * untouched, if the value doesn't fit in a long.
+ */
+int lnum_long(const char *s, size_t n, long *x);
+
+/*
+ * Parse -?[0-9]+(\.[0-9]+)? from the n bytes at s, correctly rounded to
+ * the nearest double. Uses Clinger's fast path when the digits and
+ * power of ten are both exact doubles, the Eisel-Lemire algorithm
+ * otherwise, and strtod only in the rare cases Eisel-Lemire can't
+ * decide.
+ */
+double lnum_double(const char *s, size_t n);
+
+#endif /* LNUM_H */
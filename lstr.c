@@ -0,0 +1,222 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Small string optimised ropes, see lstr.h
+ *
+ * A heap node is either a leaf owning a NUL terminated buffer, or a
+ * concatenation of two child nodes. Flattening turns a concatenation
+ * node into a leaf in place, so every string sharing it benefits. Ropes
+ * built by appending in a loop are as deep as they are long, so nothing
+ * here walks them recursively.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lstr.h"
+
+/* concatenations up to this long are copied rather than made into ropes */
+#define LSTR_FLAT_MAX   64
+
+typedef struct lstr_node {
+    int refs;
+    int leaf;
+    size_t len;
+    char *data;
+    struct lstr_node *left;
+    struct lstr_node *right;
+} lstr_node;
+
+/*
+ * Nodes
+ */
+
+/* leaf node with room for len bytes, allocated together with the node */
+static lstr_node *node_leaf(size_t len) {
+    lstr_node *n = malloc(sizeof(lstr_node) + len + 1);
+    n->refs = 1;
+    n->leaf = 1;
+    n->len = len;
+    n->data = (char *)(n + 1);
+    n->data[len] = '\0';
+    n->left = NULL;
+    n->right = NULL;
+    return n;
+}
+
+/*
+ * Both walks below visit the right child first, keeping the left one on
+ * the stack. Ropes built by appending are left leaning, so this keeps the
+ * stack at a single entry for them.
+ */
+static void node_push(lstr_node ***stack, size_t *depth, size_t *cap, lstr_node *n) {
+    if (*depth == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        *stack = realloc(*stack, sizeof(lstr_node *) * *cap);
+    }
+    (*stack)[(*depth)++] = n;
+}
+
+static void node_release(lstr_node *n) {
+    lstr_node **stack = NULL;
+    size_t depth = 0;
+    size_t cap = 0;
+
+    while (n) {
+        lstr_node *next = NULL;
+        if (--n->refs == 0) {
+            if (!n->leaf) {
+                node_push(&stack, &depth, &cap, n->left);
+                next = n->right;
+            } else if (n->data != (char *)(n + 1)) {
+                free(n->data);
+            }
+            free(n);
+        }
+        if (next == NULL && depth) {
+            next = stack[--depth];
+        }
+        n = next;
+    }
+    free(stack);
+}
+
+/* copy the bytes of every leaf under n into the n->len bytes before end */
+static void node_write(lstr_node *n, char *end) {
+    lstr_node **stack = NULL;
+    size_t depth = 0;
+    size_t cap = 0;
+
+    while (n) {
+        if (n->leaf) {
+            end -= n->len;
+            memcpy(end, n->data, n->len);
+            n = depth ? stack[--depth] : NULL;
+        } else {
+            node_push(&stack, &depth, &cap, n->left);
+            n = n->right;
+        }
+    }
+    free(stack);
+}
+
+static void node_flatten(lstr_node *n) {
+    char *data = malloc(n->len + 1);
+    node_write(n, data + n->len);
+    data[n->len] = '\0';
+    node_release(n->left);
+    node_release(n->right);
+    n->leaf = 1;
+    n->data = data;
+    n->left = NULL;
+    n->right = NULL;
+}
+
+/* the heap node behind s, creating one for an inline string */
+static lstr_node *node_of(lstr_t *s) {
+    if (s->tag == LSTR_HEAP) {
+        s->node->refs++;
+        return s->node;
+    }
+    lstr_node *n = node_leaf(s->tag);
+    memcpy(n->data, s->small, s->tag);
+    return n;
+}
+
+/*
+ * Construction
+ */
+
+lstr_t lstr_new(const char *s, size_t len) {
+    lstr_t r;
+    if (len <= LSTR_INLINE) {
+        memcpy(r.small, s, len);
+        r.small[len] = '\0';
+        r.tag = (unsigned char)len;
+    } else {
+        r.node = node_leaf(len);
+        memcpy(r.node->data, s, len);
+        r.tag = LSTR_HEAP;
+    }
+    return r;
+}
+
+lstr_t lstr_copy(lstr_t *s) {
+    if (s->tag == LSTR_HEAP) {
+        s->node->refs++;
+    }
+    return *s;
+}
+
+void lstr_delete(lstr_t *s) {
+    if (s->tag == LSTR_HEAP) {
+        node_release(s->node);
+    }
+    s->small[0] = '\0';
+    s->tag = 0;
+}
+
+/*
+ * Access
+ */
+
+size_t lstr_len(lstr_t *s) {
+    return s->tag == LSTR_HEAP ? s->node->len : s->tag;
+}
+
+const char *lstr_cstr(lstr_t *s) {
+    if (s->tag != LSTR_HEAP) {
+        return s->small;
+    }
+    if (!s->node->leaf) {
+        node_flatten(s->node);
+    }
+    return s->node->data;
+}
+
+int lstr_cmp(lstr_t *a, lstr_t *b) {
+    size_t la = lstr_len(a);
+    size_t lb = lstr_len(b);
+    int c = memcmp(lstr_cstr(a), lstr_cstr(b), la < lb ? la : lb);
+    if (c != 0) {
+        return c;
+    }
+    return la < lb ? -1 : la > lb;
+}
+
+/*
+ * Concatenation
+ */
+
+lstr_t lstr_concat(lstr_t *a, lstr_t *b) {
+    size_t la = lstr_len(a);
+    size_t lb = lstr_len(b);
+    lstr_t r;
+
+    if (la == 0) {
+        return lstr_copy(b);
+    }
+    if (lb == 0) {
+        return lstr_copy(a);
+    }
+
+    if (la + lb <= LSTR_FLAT_MAX) {
+        /* short enough that copying is cheaper than a rope node */
+        char buf[LSTR_FLAT_MAX];
+        memcpy(buf, lstr_cstr(a), la);
+        memcpy(buf + la, lstr_cstr(b), lb);
+        return lstr_new(buf, la + lb);
+    }
+
+    lstr_node *n = malloc(sizeof(lstr_node));
+    n->refs = 1;
+    n->leaf = 0;
+    n->len = la + lb;
+    n->data = NULL;
+    n->left = node_of(a);
+    n->right = node_of(b);
+    r.node = n;
+    r.tag = LSTR_HEAP;
+    return r;
+}
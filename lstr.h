@@ -0,0 +1,43 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Immutable byte strings.
+ *
+ * Strings of up to LSTR_INLINE bytes are stored inside the lstr_t itself
+ * and never touch the heap. Longer strings live in reference counted
+ * nodes, so copying a string is O(1). Concatenating long strings builds
+ * a rope node pointing at both halves instead of copying them. The rope
+ * is flattened into a single buffer the first time its bytes are needed.
+ */
+
+#ifndef LSTR_H
+#define LSTR_H
+
+#include <stddef.h>
+
+#define LSTR_INLINE 22
+#define LSTR_HEAP   0xFF
+
+struct lstr_node;
+
+typedef struct lstr_t {
+    union {
+        char small[LSTR_INLINE + 1];
+        struct lstr_node *node;
+    };
+    /* length of an inline string, or LSTR_HEAP */
+    unsigned char tag;
+} lstr_t;
+
+lstr_t lstr_new(const char *s, size_t len);
+lstr_t lstr_copy(lstr_t *s);
+void lstr_delete(lstr_t *s);
+
+size_t lstr_len(lstr_t *s);
+const char *lstr_cstr(lstr_t *s);
+int lstr_cmp(lstr_t *a, lstr_t *b);
+
+lstr_t lstr_concat(lstr_t *a, lstr_t *b);
+
+#endif /* LSTR_H */
@@ -1,5 +1,21 @@
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#define MPC_MMAP
+#endif
+
 #include "mpc.h"
 
+#ifdef MPC_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /*
 ** State Type
 */
@@ -28,15 +44,18 @@ static mpc_state_t mpc_state_new(void) {
 ** In mpc the input type has three modes of 
 ** operation: String, File and Pipe.
 **
-** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
-** The cursor can jump around at will making 
-** backtracking easy.
+** String is easy. The caller's buffer is
+** borrowed, never copied, and scanned through
+** up to its length. The cursor can jump around
+** at will making backtracking easy.
 **
 ** The second is a File which is also somewhat
 ** easy. The contents are never loaded into 
 ** memory but backtracking can still be achieved
 ** by seeking in the file at different positions.
+** Where mmap is available regular files are
+** instead mapped into memory and read just like
+** a String, which saves a libc call per char.
 **
 ** The final mode is Pipe. This is the difficult
 ** one. As we assume pipes cannot be seeked - and 
@@ -49,6 +68,13 @@ static mpc_state_t mpc_state_new(void) {
 ** back we can simply start reading from the
 ** buffer instead of the input.
 **
+** The buffer is a list of fixed size chunks
+** starting at `buffer_pos`, so adding to it
+** never moves what is already there. Once the
+** outermost mark is removed whole chunks
+** behind the cursor can never be read again
+** and are released.
+**
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
@@ -62,16 +88,69 @@ enum {
 };
 
 enum {
-  MPC_INPUT_MARKS_MIN = 32
+  MPC_INPUT_MARKS_MIN = 32,
+  MPC_INPUT_CHUNK = 4096
 };
 
+/*
+** Small allocations made while parsing come from per input slabs in a
+** few size classes, each with its own free list. A class whose list is
+** empty carves from its newest slab, and when that is used up a slab
+** twice the size is added. The first slab of each class is part of the
+** input itself, so for most parses mpc_free can tell its own memory from
+** the heap's with a range check. Further slabs are kept sorted by address
+** and searched.
+*/
+
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_MEM_CLASSES   = 5,
+  MPC_MEM_CLASS_MIN = 16,
+  MPC_MEM_CLASS_MAX = 256,
+  MPC_MEM_INLINE    = 8192,
+  MPC_MEM_SLAB_MAX  = 65536
 };
 
+typedef union {
+  char bytes[MPC_MEM_CLASSES * MPC_MEM_INLINE];
+  void *align_ptr;
+  double align_dbl;
+  long align_long;
+} mpc_mem_inline_t;
+
 typedef struct {
-  char mem[64];
-} mpc_mem_t;
+  char *start;
+  char *end;
+  int cls;
+} mpc_slab_t;
+
+typedef struct mpc_mem_free_t {
+  struct mpc_mem_free_t *next;
+} mpc_mem_free_t;
+
+/*
+** Input text shared with the AST leaves that slice into it
+*/
+
+typedef struct mpc_source_t {
+  int refs;
+  char *text;
+} mpc_source_t;
+
+static mpc_source_t *mpc_source_new(const char *string, size_t length) {
+  mpc_source_t *s = malloc(sizeof(mpc_source_t) + length + 1);
+  s->refs = 1;
+  s->text = (char*)(s + 1);
+  memcpy(s->text, string, length);
+  s->text[length] = '\0';
+  return s;
+}
+
+static void mpc_source_release(mpc_source_t *s) {
+  if (--s->refs == 0) { free(s); }
+}
+
+struct mpc_memo_t;
+static void mpc_memo_delete(struct mpc_memo_t *m);
 
 typedef struct {
 
@@ -79,10 +158,31 @@ typedef struct {
   char *filename;  
   mpc_state_t state;
   
-  char *string;
-  char *buffer;
+  const char *string;
+  long length;
   FILE *file;
   
+  char *map;
+  size_t map_len;
+  long map_offset;
+  
+  char **chunks;
+  int chunks_num;
+  int chunks_slots;
+  long buffer_pos;
+  long buffer_len;
+  
+  mpc_source_t *source;
+  int slicing;
+  
+  struct mpc_memo_t *memo;
+  
+  int lazy;
+  
+  struct mpc_frame_t *frames;
+  int frames_num;
+  int frames_slots;
+  
   int suppress;
   int backtrack;
   int marks_slots;
@@ -92,44 +192,45 @@ typedef struct {
   char *lasts;
   char last;
   
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  mpc_slab_t *slabs;
+  int slabs_num;
+  int slabs_slots;
+  char *slabs_lo;
+  char *slabs_hi;
+  char *carve[MPC_MEM_CLASSES];
+  char *carve_end[MPC_MEM_CLASSES];
+  size_t slab_size[MPC_MEM_CLASSES];
+  mpc_mem_free_t *free_list[MPC_MEM_CLASSES];
+  mpc_mem_inline_t mem;
+  
+  unsigned long mem_hits;
+  unsigned long mem_misses;
   
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
-
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-  
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
-  
-  i->state = mpc_state_new();
-  
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
-  i->buffer = NULL;
-  i->file = NULL;
-  
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-  
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-  
-  return i;
+static void mpc_mem_init(mpc_input_t *i) {
+  int c;
+  i->slabs = NULL;
+  i->slabs_num = 0;
+  i->slabs_slots = 0;
+  i->slabs_lo = NULL;
+  i->slabs_hi = NULL;
+  for (c = 0; c < MPC_MEM_CLASSES; c++) {
+    i->carve[c] = i->mem.bytes + c * MPC_MEM_INLINE;
+    i->carve_end[c] = i->carve[c] + MPC_MEM_INLINE;
+    i->slab_size[c] = MPC_MEM_INLINE * 2;
+    i->free_list[c] = NULL;
+  }
+  i->mem_hits = 0;
+  i->mem_misses = 0;
 }
 
+static void mpc_mem_delete(mpc_input_t *i);
+
 static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  const char *end;
   
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
@@ -137,11 +238,27 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   
   i->state = mpc_state_new();
   
-  i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
-  i->string[length] = '\0';
-  i->buffer = NULL;
+  /* Like a C string the input ends at the first NUL */
+  end = memchr(string, '\0', length);
+  i->string = string;
+  i->length = end ? (long)(end - string) : (long)length;
+  i->chunks = NULL;
+  i->chunks_num = 0;
+  i->chunks_slots = 0;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
   i->file = NULL;
+  i->map = NULL;
+  
+  i->source = NULL;
+  i->slicing = 0;
+  i->memo = NULL;
+  
+  i->lazy = 0;
+  
+  i->frames = NULL;
+  i->frames_num = 0;
+  i->frames_slots = 0;
   
   i->suppress = 0;
   i->backtrack = 1;
@@ -151,13 +268,16 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_mem_init(i);
   
   return i;
 
 }
 
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  return mpc_input_new_nstring(filename, string, strlen(string));
+}
+
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -169,8 +289,24 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
-  i->buffer = NULL;
+  i->length = 0;
+  i->chunks = NULL;
+  i->chunks_num = 0;
+  i->chunks_slots = 0;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
   i->file = pipe;
+  i->map = NULL;
+  
+  i->source = NULL;
+  i->slicing = 0;
+  i->memo = NULL;
+  
+  i->lazy = 0;
+  
+  i->frames = NULL;
+  i->frames_num = 0;
+  i->frames_slots = 0;
   
   i->suppress = 0;
   i->backtrack = 1;
@@ -180,13 +316,44 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_mem_init(i);
   
   return i;
   
 }
 
+#ifdef MPC_MMAP
+
+/*
+** Map the rest of a regular file and read it as a String. Anything that
+** can't be mapped, like a terminal or a socket, stays on stdio. When the
+** input is deleted the file is left just after what was consumed, the
+** same as if it had been read.
+*/
+static void mpc_input_map(mpc_input_t *i) {
+  
+  struct stat st;
+  long offset = ftell(i->file);
+  int fd = fileno(i->file);
+  void *map;
+  
+  if (offset < 0 || fstat(fd, &st) != 0) { return; }
+  if (!S_ISREG(st.st_mode) || st.st_size <= offset) { return; }
+  
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) { return; }
+  posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+  
+  i->type = MPC_INPUT_STRING;
+  i->map = map;
+  i->map_len = (size_t)st.st_size;
+  i->map_offset = offset;
+  i->string = i->map + offset;
+  i->length = (long)st.st_size - offset;
+}
+
+#endif
+
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -197,8 +364,24 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
-  i->buffer = NULL;
+  i->length = 0;
+  i->chunks = NULL;
+  i->chunks_num = 0;
+  i->chunks_slots = 0;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
   i->file = file;
+  i->map = NULL;
+  
+  i->source = NULL;
+  i->slicing = 0;
+  i->memo = NULL;
+  
+  i->lazy = 0;
+  
+  i->frames = NULL;
+  i->frames_num = 0;
+  i->frames_slots = 0;
   
   i->suppress = 0;
   i->backtrack = 1;
@@ -208,48 +391,164 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_mem_init(i);
+  
+#ifdef MPC_MMAP
+  mpc_input_map(i);
+#endif
   
   return i;
 }
 
 static void mpc_input_delete(mpc_input_t *i) {
   
+  int j;
+  
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  if (i->map) {
+#ifdef MPC_MMAP
+    fseek(i->file, i->map_offset + i->state.pos, SEEK_SET);
+    munmap(i->map, i->map_len);
+#endif
+  }
+  else if (i->type == MPC_INPUT_STRING && i->source) { mpc_source_release(i->source); }
+  for (j = 0; j < i->chunks_num; j++) { free(i->chunks[j]); }
+  free(i->chunks);
+  if (i->memo) { mpc_memo_delete(i->memo); }
+  free(i->frames);
+  
+  mpc_mem_delete(i);
   
   free(i->marks);
   free(i->lasts);
   free(i);
 }
 
-static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+/*
+** While parsing under a slice the text is taken from the input afterwards,
+** so characters and folds of characters all produce this placeholder.
+*/
+
+static char mpc_slice_val[1];
+
+/*
+** Allocator counters summed over every parse, for mpc_stats. Freed memory
+** is only ever reused by its own class, so the memory carved from a
+** class's slabs is the most it had in use at once. Peak is the largest
+** total of that over the classes of any one parse.
+*/
+static unsigned long mpc_mem_total_hits = 0;
+static unsigned long mpc_mem_total_misses = 0;
+static size_t mpc_mem_total_peak = 0;
+
+/* Class of an allocation of n bytes, indexed by (n-1) / MPC_MEM_CLASS_MIN */
+static const char mpc_mem_classes[MPC_MEM_CLASS_MAX / MPC_MEM_CLASS_MIN] = {
+  0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4
+};
+
+#define mpc_mem_class_size(c) ((size_t)MPC_MEM_CLASS_MIN << (c))
+
+/* The class of the slab p is in, or -1 if it isn't in one */
+static int mpc_mem_class(mpc_input_t *i, void *p) {
+  
+  char *x = p;
+  int lo = 0, hi = i->slabs_num - 1, mid;
+  
+  if (x >= i->mem.bytes && x < i->mem.bytes + sizeof(i->mem.bytes)) {
+    return (int)((x - i->mem.bytes) / MPC_MEM_INLINE);
+  }
+  
+  if (x < i->slabs_lo || x >= i->slabs_hi) { return -1; }
+  
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (x < i->slabs[mid].start)     { hi = mid - 1; }
+    else if (x >= i->slabs[mid].end) { lo = mid + 1; }
+    else { return i->slabs[mid].cls; }
+  }
+  
+  return -1;
+}
+
+static int mpc_mem_grow(mpc_input_t *i, int c) {
+  
+  int j;
+  size_t n = i->slab_size[c];
+  char *s = malloc(n);
+  
+  if (s == NULL) { return 0; }
+  
+  if (i->slabs_num == i->slabs_slots) {
+    i->slabs_slots = i->slabs_slots ? i->slabs_slots * 2 : 16;
+    i->slabs = realloc(i->slabs, sizeof(mpc_slab_t) * i->slabs_slots);
+  }
+  
+  for (j = i->slabs_num; j > 0 && i->slabs[j-1].start > s; j--) {
+    i->slabs[j] = i->slabs[j-1];
+  }
+  i->slabs[j].start = s;
+  i->slabs[j].end = s + n;
+  i->slabs[j].cls = c;
+  i->slabs_num++;
+  
+  if (i->slabs_lo == NULL || s < i->slabs_lo) { i->slabs_lo = s; }
+  if (i->slabs_hi == NULL || s + n > i->slabs_hi) { i->slabs_hi = s + n; }
+  
+  i->carve[c] = s;
+  i->carve_end[c] = s + n;
+  if (n < MPC_MEM_SLAB_MAX) { i->slab_size[c] = n * 2; }
+  return 1;
+}
+
+static void mpc_mem_delete(mpc_input_t *i) {
+  
+  int j;
+  size_t carved = sizeof(i->mem.bytes);
+  
+  for (j = 0; j < i->slabs_num; j++) {
+    carved += (size_t)(i->slabs[j].end - i->slabs[j].start);
+    free(i->slabs[j].start);
+  }
+  for (j = 0; j < MPC_MEM_CLASSES; j++) {
+    carved -= (size_t)(i->carve_end[j] - i->carve[j]);
+  }
+  free(i->slabs);
+  
+  mpc_mem_total_hits += i->mem_hits;
+  mpc_mem_total_misses += i->mem_misses;
+  if (carved > mpc_mem_total_peak) { mpc_mem_total_peak = carved; }
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
+  
+  int c;
   char *p;
   
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  if (n > MPC_MEM_CLASS_MAX) {
+    i->mem_misses++;
+    return malloc(n);
+  }
   
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  c = n ? mpc_mem_classes[(n-1) / MPC_MEM_CLASS_MIN] : 0;
   
-  return malloc(n);
+  if (i->free_list[c]) {
+    p = (char*)i->free_list[c];
+    i->free_list[c] = i->free_list[c]->next;
+    i->mem_hits++;
+    return p;
+  }
+  
+  if (i->carve[c] == i->carve_end[c]) {
+    i->mem_misses++;
+    if (!mpc_mem_grow(i, c)) { return malloc(n); }
+  } else {
+    i->mem_hits++;
+  }
+  
+  p = i->carve[c];
+  i->carve[c] += mpc_mem_class_size(c);
+  return p;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -258,35 +557,44 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
   return x;
 }
 
+static void mpc_mem_release(mpc_input_t *i, void *p, int c) {
+  mpc_mem_free_t *f = p;
+  f->next = i->free_list[c];
+  i->free_list[c] = f;
+}
+
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  
+  int c;
+  
+  if (p == mpc_slice_val) { return; }
+  
+  c = mpc_mem_class(i, p);
+  if (c < 0) { free(p); return; }
+  mpc_mem_release(i, p, c);
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
   
   char *q = NULL;
+  int c = mpc_mem_class(i, p);
   
-  if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
+  if (c < 0) { return realloc(p, n); }
+  if (n <= mpc_mem_class_size(c)) { return p; }
   
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
-    mpc_free(i, p);
-    return q;
-  }
-  
-  return p;
+  q = mpc_malloc(i, n);
+  memcpy(q, p, mpc_mem_class_size(c));
+  mpc_mem_release(i, p, c);
+  return q;
 }
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
-  mpc_free(i, p);
+  int c = mpc_mem_class(i, p);
+  if (c < 0) { return p; }
+  q = malloc(mpc_mem_class_size(c));
+  memcpy(q, p, mpc_mem_class_size(c));
+  mpc_mem_release(i, p, c);
   return q; 
 }
 
@@ -311,10 +619,36 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+}
+
+/*
+** Release the whole chunks behind the cursor. Only the last of them is
+** kept, as a spare for the next characters buffered.
+*/
+static void mpc_input_buffer_release(mpc_input_t *i) {
+  
+  int j, n, used;
+  long consumed = i->state.pos - i->buffer_pos;
+  char *spare;
+  
+  used = (int)((i->buffer_len + MPC_INPUT_CHUNK - 1) / MPC_INPUT_CHUNK);
+  n = consumed >= i->buffer_len ? used : (int)(consumed / MPC_INPUT_CHUNK);
+  if (n == 0) { return; }
+  
+  spare = i->chunks[n-1];
+  for (j = 0; j < n-1; j++) { free(i->chunks[j]); }
+  if (i->chunks_num > used) { free(spare); spare = NULL; }
+  memmove(i->chunks, i->chunks + n, sizeof(char*) * (i->chunks_num - n));
+  i->chunks_num -= n;
+  if (spare) { i->chunks[i->chunks_num++] = spare; }
+  
+  if (n == used) {
+    i->buffer_pos = i->state.pos;
+    i->buffer_len = 0;
+  } else {
+    i->buffer_pos += (long)n * MPC_INPUT_CHUNK;
+    i->buffer_len -= (long)n * MPC_INPUT_CHUNK;
   }
-  
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
@@ -332,9 +666,8 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);      
   }
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0 && i->buffer_len) {
+    mpc_input_buffer_release(i);
   }
   
 }
@@ -354,17 +687,36 @@ static void mpc_input_rewind(mpc_input_t *i) {
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < i->buffer_pos + i->buffer_len;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  long k = i->state.pos - i->buffer_pos;
+  return i->chunks[k / MPC_INPUT_CHUNK][k % MPC_INPUT_CHUNK];
+}
+
+static void mpc_input_buffer_put(mpc_input_t *i, char c) {
+  
+  long k = i->buffer_len;
+  
+  if (k == 0) { i->buffer_pos = i->state.pos; }
+  
+  if (k / MPC_INPUT_CHUNK == i->chunks_num) {
+    if (i->chunks_num == i->chunks_slots) {
+      i->chunks_slots = i->chunks_slots ? i->chunks_slots * 2 : 4;
+      i->chunks = realloc(i->chunks, sizeof(char*) * i->chunks_slots);
+    }
+    i->chunks[i->chunks_num++] = malloc(MPC_INPUT_CHUNK);
+  }
+  
+  i->chunks[k / MPC_INPUT_CHUNK][k % MPC_INPUT_CHUNK] = c;
+  i->buffer_len++;
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+  if (i->type == MPC_INPUT_PIPE && !mpc_input_buffer_in_range(i) && feof(i->file)) { return 1; }
   return 0;
 }
 
@@ -374,13 +726,11 @@ static char mpc_input_getc(mpc_input_t *i) {
   
   switch (i->type) {
     
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
-    
-      if (!i->buffer) { c = getc(i->file); return c; }
       
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         c = mpc_input_buffer_get(i);
         return c;
       } else {
@@ -397,7 +747,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: 
       
       c = fgetc(i->file);
@@ -408,14 +758,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
     
     case MPC_INPUT_PIPE:
       
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         return mpc_input_buffer_get(i);
       } else {
         c = getc(i->file);
@@ -436,9 +779,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
     case MPC_INPUT_PIPE: {
       
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         break;
       } else {
         ungetc(c, i->file); 
@@ -451,23 +792,27 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+  int buffered = 0;
+  
+  if (i->type == MPC_INPUT_PIPE) {
+    buffered = mpc_input_buffer_in_range(i);
+    if (!buffered && i->marks_num > 0) { mpc_input_buffer_put(i, c); }
   }
   
   i->last = c;
   i->state.pos++;
   i->state.col++;
   
+  if (buffered && i->marks_num == 0) { mpc_input_buffer_release(i); }
+  
   if (c == '\n') {
     i->state.col = 0;
     i->state.row++;
   }
   
-  if (o) {
+  if (o && i->slicing) {
+    (*o) = mpc_slice_val;
+  } else if (o) {
     (*o) = mpc_malloc(i, 2);
     (*o)[0] = c;
     (*o)[1] = '\0';
@@ -476,6 +821,18 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   return 1;
 }
 
+/*
+** A set of bytes, one bit each. mpc_optimise gives character classes one
+** so that testing a byte doesn't walk the class string.
+*/
+
+typedef struct {
+  unsigned char b[32];
+} mpc_charset_t;
+
+static void mpc_charset_add(mpc_charset_t *s, int c) { s->b[c >> 3] |= (unsigned char)(1 << (c & 7)); }
+static int mpc_charset_has(mpc_charset_t *s, int c) { return s->b[c >> 3] & (1 << (c & 7)); }
+
 static int mpc_input_any(mpc_input_t *i, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
@@ -506,6 +863,12 @@ static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
   return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
+static int mpc_input_class(mpc_input_t *i, mpc_charset_t *c, char **o) {
+  char x = mpc_input_getc(i);
+  if (mpc_input_terminated(i)) { return 0; }
+  return mpc_charset_has(c, (unsigned char)x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+}
+
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
@@ -526,6 +889,8 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
+  if (i->slicing) { *o = mpc_slice_val; return 1; }
+  
   *o = mpc_malloc(i, strlen(c) + 1);
   strcpy(*o, c);
   return 1;
@@ -639,7 +1004,7 @@ char *mpc_err_string(mpc_err_t *x) {
 
 static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
   mpc_err_t *x;
-  if (i->suppress) { return NULL; }
+  if (i->suppress || i->lazy) { return NULL; }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
@@ -655,7 +1020,7 @@ static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
 
 static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
   mpc_err_t *x;
-  if (i->suppress) { return NULL; }
+  if (i->suppress || i->lazy) { return NULL; }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
@@ -836,6 +1201,7 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   mpc_err_t *y;
   int digits = n/10 + 1;
   char *prefix;
+  if (x == NULL) { return NULL; }
   prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
   sprintf(prefix, "%i of ", n);
   y = mpc_err_repeat(i, x, prefix);
@@ -882,9 +1248,64 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_MEMO      = 25,
+  MPC_TYPE_DFA       = 26,
+  MPC_TYPE_SPAN      = 27
+};
+
+/*
+** A regex compiled to a minimised DFA. State 0 is the dead state and 1 the
+** start, and each state has a row of 256 transitions indexed by byte. The
+** regex may start with a start of input anchor and end with an end of
+** input one, which are checked either side of the scan.
+*/
+
+typedef struct mpc_dfa_t {
+  int refs;
+  int states_num;
+  int soi;
+  int eoi;
+  char *accept;
+  unsigned short *next;
+} mpc_dfa_t;
+
+static void mpc_dfa_delete(mpc_dfa_t *d);
+
+/*
+** A repeat of one character class, which mpc_optimise turns into a scan
+** over the class's bitmap. A class made of a few byte ranges is also kept
+** as the ranges, to test many bytes at once.
+*/
+
+enum {
+  MPC_SPAN_RANGES = 4
 };
 
+typedef struct {
+  int min;
+  int ranges_num;
+  unsigned char lo[MPC_SPAN_RANGES];
+  unsigned char hi[MPC_SPAN_RANGES];
+  mpc_charset_t set;
+} mpc_span_t;
+
+/*
+** Which alternatives of an `or` can start with each byte, with entry 256
+** for the end of input. Each entry is an offset into `alts`, where a list
+** is its length followed by the alternatives in order. Bytes with the same
+** list share it.
+*/
+
+typedef struct mpc_jump_t {
+  int refs;
+  int start[257];
+  int *alts;
+} mpc_jump_t;
+
+static void mpc_jump_delete(mpc_jump_t *d);
+
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
@@ -892,14 +1313,17 @@ typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
 typedef struct { char x; char y; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
-typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; mpc_charset_t *set; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; mpc_jump_t *jump; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_copy_t cp; mpc_dtor_t dx; } mpc_pdata_memo_t;
+typedef struct { mpc_parser_t *x; mpc_dfa_t *d; } mpc_pdata_dfa_t;
+typedef struct { mpc_parser_t *x; mpc_span_t *s; } mpc_pdata_span_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -917,6 +1341,9 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_memo_t memo;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_span_t span;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -924,8 +1351,36 @@ struct mpc_parser_t {
   char *name;
   char type;
   mpc_pdata_t data;
+  char slice;
+  unsigned int slice_gen;
+  unsigned int slice_mark;
+};
+
+/*
+** Slices
+**
+** A leaf can slice the input when the text it would have been given is
+** exactly the text its parser consumed. That holds for characters and
+** strings folded with mpcf_strfold, with empty strings lifted in for the
+** optional parts, and with zero width anchors dropped by mpcf_snd and
+** friends. Anything that looks at the values, like an apply, rules a
+** parser out. Tokens that drop the whitespace after them, as mpc_tok
+** does, slice just the part before the whitespace.
+**
+** Whether an mpcf_str_ast apply slices is worked out the first time it
+** runs, and again once any parser has been redefined or optimised.
+*/
+
+enum {
+  MPC_SLICE_UNKNOWN = 0,
+  MPC_SLICE_NONE    = 1,
+  MPC_SLICE_ALL     = 2,
+  MPC_SLICE_FIRST   = 3
 };
 
+static unsigned int mpc_slice_gen = 1;
+static unsigned int mpc_slice_stamp = 0;
+
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
   int j;
   for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
@@ -938,11 +1393,21 @@ static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { r
 
 static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   int j;
-  size_t l = 0;
+  size_t l = 0, m;
+  if (i->slicing) {
+    for (j = 0; j < n; j++) { mpc_free(i, xs[j]); }
+    return mpc_slice_val;
+  }
   if (n == 0) { return mpc_calloc(i, 1, 1); }
   for (j = 0; j < n; j++) { l += strlen(xs[j]); }
   xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
+  l = strlen(xs[0]);
+  for (j = 1; j < n; j++) {
+    m = strlen(xs[j]);
+    memcpy((char*)xs[0] + l, xs[j], m + 1);
+    l += m;
+    mpc_free(i, xs[j]);
+  }
   return xs[0];
 }
 
@@ -996,243 +1461,989 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
-enum {
-  MPC_PARSE_STACK_MIN = 4
-};
+static int mpc_slice_lift(mpc_ctor_t f) { return f == mpcf_ctor_str || f == mpcf_ctor_null; }
+static int mpc_slice_dtor(mpc_dtor_t d) { return d == free || d == mpcf_dtor_null; }
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+static int mpc_slice_pick(mpc_fold_t f) {
+  if (f == mpcf_fst || f == mpcf_fst_free) { return 0; }
+  if (f == mpcf_snd || f == mpcf_snd_free) { return 1; }
+  if (f == mpcf_trd || f == mpcf_trd_free) { return 2; }
+  return -1;
+}
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+/* Parsers that never consume input */
+static int mpc_slice_empty(mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_NOT:     return 1;
+    case MPC_TYPE_EXPECT:  return mpc_slice_empty(p->data.expect.x);
+    case MPC_TYPE_PREDICT: return mpc_slice_empty(p->data.predict.x);
+    default: return 0;
+  }
+}
+
+/*
+** Does p output exactly the text it consumes? Every parser reachable from
+** p has to pass, so one already seen on this walk needs no second look.
+*/
+static int mpc_slice_all(mpc_parser_t *p) {
   
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+  int j, k;
+  
+  if (p->slice_mark == mpc_slice_stamp) { return 1; }
+  p->slice_mark = mpc_slice_stamp;
   
   switch (p->type) {
-      
-    /* Basic Parsers */
-
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
     
-    /* Other parsers */
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_DFA:
+    case MPC_TYPE_SPAN:    return 1;
     
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+    case MPC_TYPE_LIFT:    return mpc_slice_lift(p->data.lift.lf);
+    case MPC_TYPE_EXPECT:  return mpc_slice_all(p->data.expect.x);
+    case MPC_TYPE_PREDICT: return mpc_slice_all(p->data.predict.x);
     
-    /* Application Parsers */
+    case MPC_TYPE_NOT:
+      return mpc_slice_lift(p->data.not.lf)
+          && mpc_slice_dtor(p->data.not.dx)
+          && mpc_slice_all(p->data.not.x);
     
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+    case MPC_TYPE_MAYBE:
+      return mpc_slice_lift(p->data.not.lf) && mpc_slice_all(p->data.not.x);
     
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      return p->data.repeat.f == mpcf_strfold && mpc_slice_all(p->data.repeat.x);
     
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+    case MPC_TYPE_COUNT:
+      return p->data.repeat.f == mpcf_strfold
+          && mpc_slice_dtor(p->data.repeat.dx)
+          && mpc_slice_all(p->data.repeat.x);
     
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e)) {      
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_slice_all(p->data.or.xs[j])) { return 0; }
       }
+      return 1;
     
-    /* Optional Parsers */
-    
-    /* TODO: Update Not Error Message */
+    case MPC_TYPE_AND:
+      k = mpc_slice_pick(p->data.and.f);
+      if (p->data.and.f != mpcf_strfold && (k < 0 || k >= p->data.and.n)) { return 0; }
+      for (j = 0; j < p->data.and.n; j++) {
+        if (j < p->data.and.n-1 && !mpc_slice_dtor(p->data.and.dxs[j])) { return 0; }
+        if (k >= 0 && j != k && !mpc_slice_empty(p->data.and.xs[j])) { return 0; }
+        if (!mpc_slice_all(p->data.and.xs[j])) { return 0; }
+      }
+      return 1;
     
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
+    default: return 0;
+  }
+}
+
+/* How the mpcf_str_ast apply p can slice its input */
+static int mpc_slice_kind(mpc_parser_t *p) {
+  
+  mpc_parser_t *x = p->data.apply.x;
+  
+  if (p->slice_gen == mpc_slice_gen) { return p->slice; }
+  p->slice_gen = mpc_slice_gen;
+  
+  mpc_slice_stamp++;
+  if (mpc_slice_all(x)) {
+    p->slice = MPC_SLICE_ALL;
+    return p->slice;
+  }
+  
+  p->slice = MPC_SLICE_NONE;
+  if (x->type == MPC_TYPE_AND && x->data.and.n == 2
+  &&  (x->data.and.f == mpcf_fst || x->data.and.f == mpcf_fst_free)
+  &&  mpc_slice_dtor(x->data.and.dxs[0])) {
+    mpc_slice_stamp++;
+    if (mpc_slice_all(x->data.and.xs[0])) { p->slice = MPC_SLICE_FIRST; }
+  }
+  return p->slice;
+}
+
+static mpc_ast_t *mpc_ast_new_slice(mpc_source_t *s, long offset, long length);
+
+/*
+** Memo Tables
+**
+** A parse's memo table maps (parser, position, input mode) to what the
+** parser did there: whether it succeeded, where it left the input, its
+** value or error, and the errors it merged into the parse's along the way.
+** Entries sit on a least recently used list and are charged their own
+** size, the size of their errors and a flat MPC_MEMO_VALUE for the value,
+** which the table cannot see inside of.
+*/
+
+enum {
+  MPC_MEMO_BUCKETS_MIN = 256,
+  MPC_MEMO_VALUE = 64
+};
+
+static size_t mpc_memo_budget_bytes = MPC_MEMO_BUDGET;
+
+void mpc_memo_budget(size_t bytes) {
+  mpc_memo_budget_bytes = bytes;
+}
+
+typedef struct mpc_memo_entry_t {
+  mpc_parser_t *p;
+  long pos;
+  int mode;
+  int ok;
+  mpc_state_t state;
+  char last;
+  mpc_val_t *output;
+  mpc_err_t *error;
+  mpc_err_t *merged;
+  size_t bytes;
+  struct mpc_memo_entry_t *next;
+  struct mpc_memo_entry_t *newer;
+  struct mpc_memo_entry_t *older;
+} mpc_memo_entry_t;
+
+typedef struct mpc_memo_t {
+  mpc_memo_entry_t **buckets;
+  size_t buckets_num;
+  size_t count;
+  size_t bytes;
+  mpc_memo_entry_t *newest;
+  mpc_memo_entry_t *oldest;
+} mpc_memo_t;
+
+static mpc_err_t *mpc_err_copy(mpc_err_t *x, size_t *bytes) {
+  
+  int j;
+  mpc_err_t *y;
+  
+  if (x == NULL) { return NULL; }
+  
+  y = malloc(sizeof(mpc_err_t));
+  *y = *x;
+  *bytes += sizeof(mpc_err_t);
+  
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  *bytes += strlen(x->filename) + 1;
+  
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+    *bytes += strlen(x->failure) + 1;
+  }
+  
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  *bytes += sizeof(char*) * x->expected_num;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+    *bytes += strlen(x->expected[j]) + 1;
+  }
+  
+  return y;
+}
+
+static size_t mpc_memo_hash(mpc_parser_t *p, long pos, int mode) {
+  size_t h = (size_t)p;
+  h ^= (h >> 7) ^ ((size_t)pos * 2654435761u) ^ (size_t)mode;
+  return h ^ (h >> 15);
+}
+
+static void mpc_memo_unlink(mpc_memo_t *m, mpc_memo_entry_t *x) {
+  if (x->newer) { x->newer->older = x->older; } else { m->newest = x->older; }
+  if (x->older) { x->older->newer = x->newer; } else { m->oldest = x->newer; }
+}
+
+static void mpc_memo_push(mpc_memo_t *m, mpc_memo_entry_t *x) {
+  x->newer = NULL;
+  x->older = m->newest;
+  if (m->newest) { m->newest->newer = x; } else { m->oldest = x; }
+  m->newest = x;
+}
+
+static void mpc_memo_free(mpc_memo_entry_t *x) {
+  if (x->output) { x->p->data.memo.dx(x->output); }
+  if (x->error) { mpc_err_delete(x->error); }
+  if (x->merged) { mpc_err_delete(x->merged); }
+  free(x);
+}
+
+static void mpc_memo_evict(mpc_memo_t *m) {
+  
+  mpc_memo_entry_t *x = m->oldest;
+  mpc_memo_entry_t **y = &m->buckets[mpc_memo_hash(x->p, x->pos, x->mode) & (m->buckets_num-1)];
+  
+  while (*y != x) { y = &(*y)->next; }
+  *y = x->next;
+  
+  mpc_memo_unlink(m, x);
+  m->count--;
+  m->bytes -= x->bytes;
+  mpc_memo_free(x);
+}
+
+static void mpc_memo_delete(mpc_memo_t *m) {
+  while (m->oldest) { mpc_memo_evict(m); }
+  free(m->buckets);
+  free(m);
+}
+
+static mpc_memo_entry_t *mpc_memo_find(mpc_memo_t *m, mpc_parser_t *p, long pos, int mode) {
+  
+  mpc_memo_entry_t *x = m->buckets[mpc_memo_hash(p, pos, mode) & (m->buckets_num-1)];
+  
+  for (; x; x = x->next) {
+    if (x->p == p && x->pos == pos && x->mode == mode) {
+      mpc_memo_unlink(m, x);
+      mpc_memo_push(m, x);
+      return x;
+    }
+  }
+  
+  return NULL;
+}
+
+static void mpc_memo_grow(mpc_memo_t *m) {
+  
+  size_t j, k, n = m->buckets_num * 2;
+  mpc_memo_entry_t **buckets = calloc(n, sizeof(mpc_memo_entry_t*));
+  mpc_memo_entry_t *x, *next;
+  
+  for (j = 0; j < m->buckets_num; j++) {
+    for (x = m->buckets[j]; x; x = next) {
+      next = x->next;
+      k = mpc_memo_hash(x->p, x->pos, x->mode) & (n-1);
+      x->next = buckets[k];
+      buckets[k] = x;
+    }
+  }
+  
+  free(m->buckets);
+  m->buckets = buckets;
+  m->buckets_num = n;
+}
+
+static void mpc_memo_add(mpc_input_t *i, mpc_parser_t *p, long pos, int mode,
+  int ok, mpc_result_t *r, mpc_err_t *merged) {
+  
+  mpc_memo_t *m = i->memo;
+  mpc_memo_entry_t *x;
+  size_t k;
+  
+  if (m == NULL) {
+    m = i->memo = malloc(sizeof(mpc_memo_t));
+    m->buckets_num = MPC_MEMO_BUCKETS_MIN;
+    m->buckets = calloc(m->buckets_num, sizeof(mpc_memo_entry_t*));
+    m->count = 0;
+    m->bytes = 0;
+    m->newest = NULL;
+    m->oldest = NULL;
+  }
+  
+  x = malloc(sizeof(mpc_memo_entry_t));
+  x->p = p;
+  x->pos = pos;
+  x->mode = mode;
+  x->ok = ok;
+  x->state = i->state;
+  x->last = i->last;
+  x->bytes = sizeof(mpc_memo_entry_t);
+  x->output = NULL;
+  x->error = NULL;
+  if (ok && r->output) {
+    x->output = p->data.memo.cp(r->output);
+    x->bytes += MPC_MEMO_VALUE;
+  }
+  if (!ok) { x->error = mpc_err_copy(r->error, &x->bytes); }
+  x->merged = mpc_err_copy(merged, &x->bytes);
+  
+  if (x->bytes > mpc_memo_budget_bytes) { mpc_memo_free(x); return; }
+  while (m->bytes + x->bytes > mpc_memo_budget_bytes) { mpc_memo_evict(m); }
+  
+  if (m->count >= m->buckets_num) { mpc_memo_grow(m); }
+  k = mpc_memo_hash(p, pos, mode) & (m->buckets_num-1);
+  x->next = m->buckets[k];
+  m->buckets[k] = x;
+  mpc_memo_push(m, x);
+  m->count++;
+  m->bytes += x->bytes;
+}
+
+/*
+** Memoised parsers. Suppressed errors and disabled backtracking both change
+** what a parser gives, so they are part of the key. The errors it merges
+** are collected apart from the parse's so that a later hit can merge the
+** same ones. Under a slice values are placeholders that cannot be copied,
+** so there it just runs.
+*/
+static int mpc_memo_mode(mpc_input_t *i) {
+  return (i->suppress > 0) | (i->backtrack < 1) << 1;
+}
+
+/* Give what p gave here before, merging what it merged into e, or -1 if unknown */
+static int mpc_memo_hit(mpc_input_t *i, mpc_parser_t *p, int mode, mpc_result_t *r, mpc_err_t **e) {
+  
+  mpc_memo_entry_t *x = i->memo ? mpc_memo_find(i->memo, p, i->state.pos, mode) : NULL;
+  size_t bytes = 0;
+  
+  if (x == NULL) { return -1; }
+  
+  i->state = x->state;
+  i->last = x->last;
+  if (x->merged) { *e = mpc_err_merge(i, *e, mpc_err_copy(x->merged, &bytes)); }
+  if (!x->ok) { r->error = mpc_err_copy(x->error, &bytes); return 0; }
+  r->output = x->output ? p->data.memo.cp(x->output) : NULL;
+  return 1;
+}
+
+/* Consume the n bytes at start that a scan matched and output them */
+static int mpc_parse_scanned(mpc_input_t *i, const unsigned char *start, long n, mpc_result_t *r) {
+  
+  long j, k, newline = -1;
+  char *out;
+  
+  for (j = 0; j < n; j++) {
+    if (start[j] == '\n') { i->state.row++; newline = j; }
+  }
+  i->state.col = newline < 0 ? i->state.col + n : n - newline - 1;
+  i->state.pos += n;
+  if (n > 0) { i->last = (char)start[n-1]; }
+  
+  if (i->slicing) {
+    r->output = mpc_slice_val;
+    return 1;
+  }
+  
+  /* the combinators fold each byte as a string, so NULs drop out */
+  out = mpc_malloc(i, n + 1);
+  for (j = 0, k = 0; j < n; j++) {
+    if (start[j] != '\0') { out[k++] = (char)start[j]; }
+  }
+  out[k] = '\0';
+  r->output = out;
+  return 1;
+}
+
+/*
+** Run a compiled regex. The scan keeps the end of the longest match, which
+** for the regexes mpc_re compiles is where the combinators would stop too.
+**
+** The scan makes none of the errors the combinators would have made on the
+** way, so it only runs while errors are left out. When they are being
+** built, after a parse has failed, the combinators run instead.
+*/
+static int mpc_parse_dfa(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  
+  mpc_dfa_t *d = p->data.dfa.d;
+  const unsigned char *start, *end, *x, *match;
+  unsigned int state = 1;
+  
+  start = (const unsigned char*)i->string + i->state.pos;
+  end = (const unsigned char*)i->string + i->length;
+  match = d->accept[state] ? start : NULL;
+  
+  for (x = start; x < end; x++) {
+    state = d->next[state * 256 + *x];
+    if (state == 0) { break; }
+    if (d->accept[state]) { match = x + 1; }
+  }
+  
+  if (match == NULL
+  || (d->soi && i->last != '\0')
+  || (d->eoi && match < end && *match != '\0')) {
+    r->error = NULL;
+    return 0;
+  }
+  
+  return mpc_parse_scanned(i, start, (long)(match - start), r);
+}
+
+/*
+** Scan a span of bytes in its class. Blocks of 16 bytes are tested against
+** each range at once, and whatever is left a byte at a time.
+*/
+static const unsigned char *mpc_span_scan(mpc_span_t *s, const unsigned char *x, const unsigned char *end) {
+  
+#if defined(__SSE2__)
+  int j, out;
+  __m128i c, d, miss;
+  __m128i bias = _mm_set1_epi8((char)0x80);
+  
+  if (s->ranges_num > 0) {
+    while (end - x >= 16) {
+      c = _mm_loadu_si128((const __m128i*)x);
+      miss = _mm_set1_epi8((char)0xFF);
+      for (j = 0; j < s->ranges_num; j++) {
+        /* c - lo > hi - lo as unsigned bytes, done as signed by flipping */
+        d = _mm_xor_si128(_mm_sub_epi8(c, _mm_set1_epi8((char)s->lo[j])), bias);
+        miss = _mm_and_si128(miss, _mm_cmpgt_epi8(d,
+          _mm_set1_epi8((char)((s->hi[j] - s->lo[j]) ^ 0x80))));
       }
+      out = _mm_movemask_epi8(miss);
+      if (out) { return x + __builtin_ctz((unsigned int)out); }
+      x += 16;
+    }
+  }
+#endif
+  
+  while (x < end && mpc_charset_has(&s->set, *x)) { x++; }
+  return x;
+}
+
+/* Run a span, which like a compiled regex only runs while errors are left out */
+static int mpc_parse_span(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  
+  mpc_span_t *s = p->data.span.s;
+  const unsigned char *start, *x;
+  
+  start = (const unsigned char*)i->string + i->state.pos;
+  x = mpc_span_scan(s, start, (const unsigned char*)i->string + i->length);
+  
+  if (x - start < s->min) {
+    r->error = NULL;
+    return 0;
+  }
+  
+  return mpc_parse_scanned(i, start, (long)(x - start), r);
+}
+
+/*
+** Parse Engine
+**
+** Parsers run from a stack of frames kept on the input instead of on the
+** C stack, so how deep a grammar can nest is set by mpc_depth_budget and
+** not by the size of the thread's stack. A parser that runs others takes
+** a frame, and is resumed each time one of them finishes with its result
+** in `res`, to do what it does between them. Those that don't take none.
+**
+** The errors parsers merge go to the parse's, or while a memoised parser
+** runs to its frame's. That is kept as the index of the frame as the
+** stack can move when it grows.
+*/
+
+enum {
+  MPC_PARSE_STACK_MIN = 4,
+  MPC_PARSE_FRAMES_MIN = 64
+};
+
+typedef struct mpc_frame_t {
+  mpc_parser_t *p;
+  int step;
+  int sink;
+  int mode;
+  int slots;
+  long pos;
+  long end;
+  mpc_parser_t *rest;
+  const int *alts;
+  mpc_err_t *merged;
+  mpc_result_t *results;
+  mpc_result_t stk[MPC_PARSE_STACK_MIN];
+} mpc_frame_t;
+
+static int mpc_depth_budget_frames = MPC_DEPTH_BUDGET;
+
+void mpc_depth_budget(int depth) {
+  mpc_depth_budget_frames = depth;
+}
+
+/* Make room for one more frame, unless that would go past the budget */
+static int mpc_parse_grow(mpc_input_t *i) {
+  if (i->frames_num >= mpc_depth_budget_frames) { return 0; }
+  if (i->frames_num == i->frames_slots) {
+    i->frames_slots = i->frames_slots ? i->frames_slots * 2 : MPC_PARSE_FRAMES_MIN;
+    i->frames = realloc(i->frames, sizeof(mpc_frame_t) * i->frames_slots);
+  }
+  return 1;
+}
+
+static mpc_result_t *mpc_frame_results(mpc_frame_t *f) {
+  return f->results ? f->results : f->stk;
+}
+
+/* Make room for more results than the frame has */
+static void mpc_frame_grow(mpc_input_t *i, mpc_frame_t *f) {
+  f->slots = f->slots + f->slots / 2;
+  if (f->results) {
+    f->results = mpc_realloc(i, f->results, sizeof(mpc_result_t) * f->slots);
+  } else {
+    f->results = mpc_malloc(i, sizeof(mpc_result_t) * f->slots);
+    memcpy(f->results, f->stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+  }
+}
+
+static void mpc_frame_reserve(mpc_input_t *i, mpc_frame_t *f, int n) {
+  if (n > MPC_PARSE_STACK_MIN) {
+    f->results = mpc_malloc(i, sizeof(mpc_result_t) * n);
+    f->slots = n;
+  }
+}
+
+static mpc_err_t **mpc_parse_sink(mpc_input_t *i, mpc_err_t **e, int sink) {
+  return sink < 0 ? e : &i->frames[sink].merged;
+}
+
+#define MPC_PRIMITIVE(x) \
+  if (x) { return 1; } \
+  else { r->error = NULL; return 0; }
+
+/*
+** Run a parser that needs no frame, or give -1 if it does. That is one that
+** runs no other, or one that only wraps such a parser, which runs it in
+** place. Compiled regexes and spans only run on their own while errors are
+** left out, as they make none of the errors their combinators do.
+*/
+static int mpc_parse_flat(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  
+  int ok;
+  
+  switch (p->type) {
+    
+    /* Basic Parsers */
+    
+    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
+    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
+    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
+    case MPC_TYPE_ONEOF:
+      if (p->data.string.set) { MPC_PRIMITIVE(mpc_input_class(i, p->data.string.set, (char**)&r->output)); }
+      MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_NONEOF:
+      if (p->data.string.set) { MPC_PRIMITIVE(mpc_input_class(i, p->data.string.set, (char**)&r->output)); }
+      MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
+    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    
+    /* Other parsers */
+    
+    case MPC_TYPE_UNDEFINED: r->error = mpc_err_fail(i, "Parser Undefined!"); return 0;
+    case MPC_TYPE_PASS:      r->output = NULL; return 1;
+    case MPC_TYPE_FAIL:      r->error = mpc_err_fail(i, p->data.fail.m); return 0;
+    case MPC_TYPE_LIFT:      r->output = p->data.lift.lf(); return 1;
+    case MPC_TYPE_LIFT_VAL:  r->output = p->data.lift.x; return 1;
+    case MPC_TYPE_STATE:     r->output = mpc_input_state_copy(i); return 1;
+    
+    case MPC_TYPE_DFA:  return i->lazy ? mpc_parse_dfa(i, p, r) : -1;
+    case MPC_TYPE_SPAN: return i->lazy ? mpc_parse_span(i, p, r) : -1;
+    
+    /* Wrappers */
+    
+    case MPC_TYPE_APPLY:
+      if (p->data.apply.f == mpcf_str_ast && i->source
+      &&  mpc_slice_kind(p) != MPC_SLICE_NONE) { return -1; }
+      ok = mpc_parse_flat(i, p->data.apply.x, r, e);
+      if (ok > 0) { r->output = mpc_parse_apply(i, p->data.apply.f, r->output); }
+      return ok;
+    
+    case MPC_TYPE_APPLY_TO:
+      ok = mpc_parse_flat(i, p->data.apply_to.x, r, e);
+      if (ok > 0) { r->output = mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d); }
+      return ok;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_input_suppress_enable(i);
+      ok = mpc_parse_flat(i, p->data.expect.x, r, e);
+      mpc_input_suppress_disable(i);
+      if (ok == 0) { r->error = mpc_err_new(i, p->data.expect.m); }
+      return ok;
     
     case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
-        MPC_SUCCESS(r->output);
-      } else {
+      ok = mpc_parse_flat(i, p->data.not.x, r, e);
+      if (ok == 0) {
         *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
+        r->output = p->data.not.lf();
+        return 1;
+      }
+      return ok;
+    
+    default: return -1;
+  }
+  
+}
+
+#undef MPC_PRIMITIVE
+
+/* Parsers that always need a frame, which needn't try to do without */
+enum {
+  MPC_FRAMED = 1 << MPC_TYPE_PREDICT | 1 << MPC_TYPE_NOT
+             | 1 << MPC_TYPE_MANY | 1 << MPC_TYPE_MANY1 | 1 << MPC_TYPE_COUNT
+             | 1 << MPC_TYPE_OR | 1 << MPC_TYPE_AND | 1 << MPC_TYPE_MEMO
+};
+
+#define MPC_RETURN(x) ok = x; goto done
+#define MPC_SUCCESS(x) res.output = x; MPC_RETURN(1)
+#define MPC_FAILURE(x) res.error = x; MPC_RETURN(0)
+#define MPC_LEAVE(x) ok = x; goto leave
+#define MPC_PUSH() \
+  if ((i->frames_num == i->frames_slots || i->frames_num >= mpc_depth_budget_frames) \
+  &&  !mpc_parse_grow(i)) { \
+    res.error = mpc_err_fail(i, "Parser nesting too deep!"); \
+    MPC_LEAVE(0); \
+  } \
+  f = &i->frames[i->frames_num++]; \
+  f->p = p; \
+  f->step = 0; \
+  f->slots = MPC_PARSE_STACK_MIN; \
+  f->results = NULL
+#define MPC_RUN(x) \
+  c = x; \
+  ok = (1 << c->type) & MPC_FRAMED ? -1 : mpc_parse_flat(i, c, &res, mpc_parse_sink(i, e, sink)); \
+  if (ok < 0) { p = c; goto enter; }
+#define MPC_KEEP() \
+  if (f->step == f->slots) { mpc_frame_grow(i, f); } \
+  mpc_frame_results(f)[f->step++] = res
+#define MPC_CALL(x, k) \
+  MPC_RUN(x); \
+  goto k
+#define MPC_MERGE(x) \
+  s = mpc_parse_sink(i, e, sink); \
+  *s = mpc_err_merge(i, *s, x)
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  
+  int base = i->frames_num, sink = -1, ok, mode, j;
+  mpc_frame_t *f;
+  mpc_result_t res, *results;
+  mpc_parser_t *c;
+  mpc_err_t **s;
+  const int *alts;
+  
+  res.output = NULL;
+  ok = mpc_parse_flat(i, p, &res, e);
+  if (ok >= 0) { goto leave; }
+  
+enter:
+  
+  /* Start a parser that needs a frame, unless it turns out it doesn't */
+  
+  switch (p->type) {
+    
+    /* Application Parsers */
+    
+    /*
+    ** An mpcf_str_ast apply that slices runs its parser with slicing on,
+    ** so nothing under it allocates text, and makes the leaf from the
+    ** span of input it consumed.
+    */
+    case MPC_TYPE_APPLY:
+      MPC_PUSH();
+      if (p->data.apply.f == mpcf_str_ast && i->source
+      &&  mpc_slice_kind(p) != MPC_SLICE_NONE) {
+        c = p->data.apply.x;
+        f->rest = NULL;
+        if (p->slice == MPC_SLICE_FIRST) {
+          f->rest = c->data.and.xs[1];
+          c = c->data.and.xs[0];
+          mpc_input_mark(i);
+        }
+        f->step = 1;
+        f->pos = i->state.pos;
+        i->slicing++;
+        MPC_CALL(c, resume_apply);
+      }
+      MPC_CALL(p->data.apply.x, resume_apply);
+    
+    case MPC_TYPE_APPLY_TO:
+      MPC_PUSH();
+      MPC_CALL(p->data.apply_to.x, resume_apply_to);
+    
+    case MPC_TYPE_EXPECT:
+      MPC_PUSH();
+      mpc_input_suppress_enable(i);
+      MPC_CALL(p->data.expect.x, resume_expect);
+    
+    case MPC_TYPE_PREDICT:
+      MPC_PUSH();
+      mpc_input_backtrack_disable(i);
+      MPC_CALL(p->data.predict.x, resume_predict);
+    
+    case MPC_TYPE_MEMO:
+      if (i->type != MPC_INPUT_STRING || i->slicing) {
+        MPC_PUSH();
+        MPC_CALL(p->data.memo.x, resume_memo);
       }
+      mode = mpc_memo_mode(i);
+      ok = mpc_memo_hit(i, p, mode, &res, mpc_parse_sink(i, e, sink));
+      if (ok >= 0) { goto leave; }
+      MPC_PUSH();
+      f->step = 1;
+      f->mode = mode;
+      f->pos = i->state.pos;
+      f->sink = sink;
+      f->merged = NULL;
+      sink = i->frames_num-1;
+      MPC_CALL(p->data.memo.x, resume_memo);
+    
+    case MPC_TYPE_DFA:
+      MPC_PUSH();
+      MPC_CALL(p->data.dfa.x, resume_combinators);
+    
+    case MPC_TYPE_SPAN:
+      MPC_PUSH();
+      MPC_CALL(p->data.span.x, resume_combinators);
+    
+    /* Optional Parsers */
+    
+    case MPC_TYPE_NOT:
+      MPC_PUSH();
+      mpc_input_mark(i);
+      mpc_input_suppress_enable(i);
+      MPC_CALL(p->data.not.x, resume_not);
+    
+    case MPC_TYPE_MAYBE:
+      MPC_PUSH();
+      MPC_CALL(p->data.not.x, resume_maybe);
     
     /* Repeat Parsers */
     
     case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      MPC_PUSH();
+      MPC_CALL(p->data.repeat.x, resume_many);
+    
+    case MPC_TYPE_COUNT:
+      MPC_PUSH();
+      mpc_frame_reserve(i, f, p->data.repeat.n);
+      MPC_CALL(p->data.repeat.x, resume_count);
+    
+    /* Combinatory Parsers */
+    
+    /*
+    ** An `or` with a jump table tries only the alternatives that can start
+    ** with the next byte. Those skipped would have failed here, so all
+    ** that is lost is their errors, and it is only used while errors are
+    ** left out.
+    */
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { res.output = NULL; MPC_LEAVE(1); }
+      alts = NULL;
+      if (p->data.or.jump && i->lazy) {
+        j = i->state.pos < i->length ? (unsigned char)i->string[i->state.pos] : 256;
+        alts = p->data.or.jump->alts + p->data.or.jump->start[j];
+        if (alts[0] == 0) { res.error = NULL; MPC_LEAVE(0); }
+      }
+      MPC_PUSH();
+      f->alts = alts;
+      MPC_CALL(p->data.or.xs[alts ? alts[1] : 0], resume_or);
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) { res.output = NULL; MPC_LEAVE(1); }
+      MPC_PUSH();
+      mpc_frame_reserve(i, f, p->data.and.n);
+      mpc_input_mark(i);
+      MPC_CALL(p->data.and.xs[0], resume_and);
+    
+    /* End */
+    
+    default:
+      res.error = mpc_err_fail(i, "Unknown Parser Type Id!");
+      MPC_LEAVE(0);
+  
+  }
+  
+resume:
+  
+  /*
+  ** Resume the innermost frame with what the parser it ran gave. Those
+  ** that run several keep going here for as long as they need no frame.
+  */
+  
+  f = &i->frames[i->frames_num-1];
+  p = f->p;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_APPLY:
+    resume_apply:
       
-      results = results_stk;
+      if (f->step == 0) {
+        if (ok) { MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, res.output)); }
+        MPC_RETURN(0);
+      }
       
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+      if (f->step == 1) {
+        i->slicing--;
+        if (!ok) {
+          if (f->rest) { mpc_input_rewind(i); }
+          MPC_RETURN(0);
         }
+        mpc_free(i, res.output);
+        f->end = i->state.pos;
+        f->step = 2;
+        if (f->rest) { MPC_CALL(f->rest, resume_apply); }
+        MPC_SUCCESS(mpc_ast_new_slice(i->source, f->pos, f->end - f->pos));
       }
       
-      *e = mpc_err_merge(i, *e, results[j].error);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      if (!ok) {
+        mpc_input_rewind(i);
+        MPC_RETURN(0);
+      }
+      mpc_input_unmark(i);
+      if (p->data.apply.x->data.and.f == mpcf_fst_free) { mpc_free(i, res.output); }
+      MPC_SUCCESS(mpc_ast_new_slice(i->source, f->pos, f->end - f->pos));
+    
+    case MPC_TYPE_APPLY_TO:
+    resume_apply_to:
+      if (ok) { MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, res.output, p->data.apply_to.d)); }
+      MPC_RETURN(0);
+    
+    case MPC_TYPE_EXPECT:
+    resume_expect:
+      mpc_input_suppress_disable(i);
+      if (ok) { MPC_RETURN(1); }
+      MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+    
+    case MPC_TYPE_PREDICT:
+    resume_predict:
+      mpc_input_backtrack_enable(i);
+      MPC_RETURN(ok);
+    
+    case MPC_TYPE_MEMO:
+    resume_memo:
+      if (f->step == 1) {
+        sink = f->sink;
+        mpc_memo_add(i, p, f->pos, f->mode, ok, &res, f->merged);
+        if (f->merged) { MPC_MERGE(f->merged); }
+      }
+      MPC_RETURN(ok);
+    
+    /* TODO: Update Not Error Message */
+    
+    case MPC_TYPE_NOT:
+    resume_not:
+      if (ok) {
+        mpc_input_rewind(i);
+        mpc_input_suppress_disable(i);
+        mpc_parse_dtor(i, p->data.not.dx, res.output);
+        MPC_FAILURE(mpc_err_new(i, "opposite"));
+      }
+      mpc_input_unmark(i);
+      mpc_input_suppress_disable(i);
+      MPC_SUCCESS(p->data.not.lf());
     
+    case MPC_TYPE_MAYBE:
+    resume_maybe:
+      if (ok) { MPC_RETURN(1); }
+      MPC_MERGE(res.error);
+      MPC_SUCCESS(p->data.not.lf());
+    
+    case MPC_TYPE_MANY:
     case MPC_TYPE_MANY1:
+    resume_many:
       
-      results = results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
+      while (ok) {
+        MPC_KEEP();
+        MPC_RUN(p->data.repeat.x);
       }
       
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        *e = mpc_err_merge(i, *e, results[j].error);
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      if (p->type == MPC_TYPE_MANY1 && f->step == 0) {
+        MPC_FAILURE(mpc_err_many1(i, res.error));
       }
+      
+      MPC_MERGE(res.error);
+      MPC_SUCCESS(mpc_parse_fold(i, p->data.repeat.f, f->step, (mpc_val_t**)mpc_frame_results(f)));
     
     case MPC_TYPE_COUNT:
+    resume_count:
       
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
-      
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+      while (ok) {
+        MPC_KEEP();
+        if (f->step == p->data.repeat.n) {
+          MPC_SUCCESS(mpc_parse_fold(i, p->data.repeat.f, f->step, (mpc_val_t**)mpc_frame_results(f)));
         }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });  
+        MPC_RUN(p->data.repeat.x);
       }
       
-    /* Combinatory Parsers */
+      results = mpc_frame_results(f);
+      for (j = 0; j < f->step; j++) {
+        mpc_parse_dtor(i, p->data.repeat.dx, results[j].output);
+      }
+      MPC_FAILURE(mpc_err_count(i, res.error, p->data.repeat.n));
     
     case MPC_TYPE_OR:
+    resume_or:
       
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
-      
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-      
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      while (!ok) {
+        MPC_MERGE(res.error);
+        f->step++;
+        if (f->alts) {
+          if (f->step == f->alts[0]) { MPC_FAILURE(NULL); }
+          MPC_RUN(p->data.or.xs[f->alts[f->step+1]]);
         } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        } 
+          if (f->step == p->data.or.n) { MPC_FAILURE(NULL); }
+          MPC_RUN(p->data.or.xs[f->step]);
+        }
       }
       
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      MPC_RETURN(1);
     
-    case MPC_TYPE_AND:
-      
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
-      
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+    case MPC_TYPE_AND:
+    resume_and:
       
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      while (ok) {
+        MPC_KEEP();
+        if (f->step == p->data.and.n) {
+          mpc_input_unmark(i);
+          MPC_SUCCESS(mpc_parse_fold(i, p->data.and.f, f->step, (mpc_val_t**)mpc_frame_results(f)));
         }
+        MPC_RUN(p->data.and.xs[f->step]);
+      }
+      
+      mpc_input_rewind(i);
+      results = mpc_frame_results(f);
+      for (j = 0; j < f->step; j++) {
+        mpc_parse_dtor(i, p->data.and.dxs[j], results[j].output);
       }
-      mpc_input_unmark(i); 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      MPC_RETURN(0);
     
-    /* End */
+    /* Compiled regexes and spans that ran their combinators */
     
     default:
-      
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    resume_combinators:
+      MPC_RETURN(ok);
+  
   }
   
-  return 0;
+done:
+  
+  if (f->results) { mpc_free(i, f->results); }
+  i->frames_num--;
+  
+leave:
+  
+  if (i->frames_num > base) { goto resume; }
+  
+  *r = res;
+  return ok;
   
 }
 
+#undef MPC_RETURN
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
-#undef MPC_PRIMITIVE
-
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+#undef MPC_LEAVE
+#undef MPC_PUSH
+#undef MPC_RUN
+#undef MPC_KEEP
+#undef MPC_CALL
+#undef MPC_MERGE
+
+static int mpc_parse_eager(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
@@ -1246,6 +2457,36 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   return x;
 }
 
+/*
+** A string is first parsed with errors left out, so a parse that succeeds
+** builds none. Only if it fails is the string parsed again from the same
+** place building them. Other input can't be read twice, so it builds them
+** as it goes.
+*/
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  
+  int x;
+  mpc_state_t state = i->state;
+  char last = i->last;
+  mpc_err_t *e = NULL;
+  
+  if (i->type != MPC_INPUT_STRING) { return mpc_parse_eager(i, p, r); }
+  
+  i->lazy = 1;
+  x = mpc_parse_run(i, p, r, &e);
+  i->lazy = 0;
+  
+  if (x) {
+    r->output = mpc_export(i, r->output);
+    return x;
+  }
+  
+  if (i->memo) { mpc_memo_delete(i->memo); i->memo = NULL; }
+  i->state = state;
+  i->last = last;
+  return mpc_parse_eager(i, p, r);
+}
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_string(filename, string);
@@ -1262,6 +2503,20 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
   return x;
 }
 
+int mpc_parse_slices(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_nparse_slices(filename, string, strlen(string), p, r);
+}
+
+int mpc_nparse_slices(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  i->source = mpc_source_new(string, i->length);
+  i->string = i->source->text;
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
@@ -1307,6 +2562,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  if (p->data.or.jump) { mpc_jump_delete(p->data.or.jump); }
   
 }
 
@@ -1333,11 +2589,23 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_NONEOF:
     case MPC_TYPE_STRING:
       free(p->data.string.x); 
+      free(p->data.string.set);
       break;
     
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      mpc_dfa_delete(p->data.dfa.d);
+      break;
+    
+    case MPC_TYPE_SPAN:
+      mpc_undefine_unretained(p->data.span.x, 0);
+      free(p->data.span.s);
+      break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1431,11 +2699,27 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
     case MPC_TYPE_STRING:
       p->data.string.x = malloc(strlen(a->data.string.x)+1);
       strcpy(p->data.string.x, a->data.string.x);
+      if (a->data.string.set) {
+        p->data.string.set = malloc(sizeof(mpc_charset_t));
+        memcpy(p->data.string.set, a->data.string.set, sizeof(mpc_charset_t));
+      }
       break;
     
     case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
     case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
     case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_MEMO:     p->data.memo.x     = mpc_copy(a->data.memo.x);     break;
+    
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.d->refs++;
+      break;
+    
+    case MPC_TYPE_SPAN:
+      p->data.span.x = mpc_copy(a->data.span.x);
+      p->data.span.s = malloc(sizeof(mpc_span_t));
+      memcpy(p->data.span.s, a->data.span.s, sizeof(mpc_span_t));
+      break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1459,6 +2743,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      if (p->data.or.jump) { p->data.or.jump->refs++; }
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1479,6 +2764,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
 }
 
 mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  mpc_slice_gen++;
   mpc_undefine_unretained(p, 1);
   p->type = MPC_TYPE_UNDEFINED;
   return p;
@@ -1486,6 +2772,8 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
 
 mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   
+  mpc_slice_gen++;
+  
   if (p->retained) {
     p->type = a->type;
     p->data = a->data;
@@ -1726,6 +3014,15 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_copy_t cp, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.cp = cp;
+  p->data.memo.dx = da;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -2091,69 +3388,539 @@ static const char *mpc_re_range_escape_char(char c) {
     case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
     default: return NULL;
   }
-}
-
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  
+  mpc_parser_t *out;
+  size_t i, j;
+  size_t start, end;
+  const char *tmp = NULL;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range = calloc(1,1);
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  for (i = comp; i < strlen(s); i++){
+    
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];      
+      }
+      i++;
+    }
+    
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = (char)j;
+        }        
+      }
+    }
+    
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+  
+  }
+  
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  
+  free(x);
+  free(range);
+  
+  return out;
+}
+
+/*
+** Regex DFAs
+**
+** The combinators mpc_re builds take the first branch of an `|` that
+** matches and repeat as often as they can without giving any back, while
+** a DFA finds the longest match. The two agree when every choice can be
+** made from the next byte alone: the branches of an `|` start with
+** different bytes and only the last can match nothing, and no optional or
+** repeated part can start with a byte that could also follow it. Regexes
+** like that are compiled to a DFA, and the rest keep their combinators, as
+** do regexes with anchors other than a leading `^` and a trailing `$`.
+*/
+
+enum {
+  MPC_DFA_NFA_MAX    = 2048,
+  MPC_DFA_STATES_MAX = 512
+};
+
+enum {
+  MPC_NFA_CHAR  = 0,
+  MPC_NFA_SPLIT = 1,
+  MPC_NFA_MATCH = 2
+};
+
+typedef struct {
+  int type;
+  int out;
+  int out1;
+  mpc_charset_t set;
+} mpc_nfa_state_t;
+
+typedef struct {
+  int num;
+  mpc_nfa_state_t states[MPC_DFA_NFA_MAX];
+} mpc_nfa_t;
+
+static void mpc_charset_union(mpc_charset_t *s, mpc_charset_t *t) {
+  int j;
+  for (j = 0; j < 32; j++) { s->b[j] |= t->b[j]; }
+}
+
+static int mpc_charset_meets(mpc_charset_t *s, mpc_charset_t *t) {
+  int j;
+  for (j = 0; j < 32; j++) { if (s->b[j] & t->b[j]) { return 1; } }
+  return 0;
+}
+
+static mpc_parser_t *mpc_dfa_strip(mpc_parser_t *p) {
+  while (p->type == MPC_TYPE_EXPECT || p->type == MPC_TYPE_SPAN) {
+    p = p->type == MPC_TYPE_EXPECT ? p->data.expect.x : p->data.span.x;
+  }
+  return p;
+}
+
+/* The bytes a single character parser accepts, tested the way it does */
+static int mpc_dfa_leaf(mpc_parser_t *p, mpc_charset_t *s) {
+  
+  int c;
+  char x;
+  
+  memset(s, 0, sizeof(mpc_charset_t));
+  
+  for (c = 0; c < 256; c++) {
+    x = (char)c;
+    switch (p->type) {
+      case MPC_TYPE_ANY:     break;
+      case MPC_TYPE_SINGLE:  if (x != p->data.single.x) { continue; } break;
+      case MPC_TYPE_RANGE:   if (x < p->data.range.x || x > p->data.range.y) { continue; } break;
+      case MPC_TYPE_ONEOF:   if (strchr(p->data.string.x, x) == 0) { continue; } break;
+      case MPC_TYPE_NONEOF:  if (strchr(p->data.string.x, x) != 0) { continue; } break;
+      case MPC_TYPE_SATISFY: if (!p->data.satisfy.f(x)) { continue; } break;
+      default: return 0;
+    }
+    mpc_charset_add(s, c);
+  }
+  
+  return 1;
+}
+
+static int mpc_dfa_empty(mpc_parser_t *p) {
+  return p->type == MPC_TYPE_LIFT && p->data.lift.lf == mpcf_ctor_str;
+}
+
+/* The anchor function of a `^` or `$` as mpc_re builds them, else NULL */
+static int (*mpc_dfa_anchor(mpc_parser_t *p))(char,char) {
+  mpc_parser_t *a;
+  p = mpc_dfa_strip(p);
+  if (p->type != MPC_TYPE_AND || p->data.and.n != 2 || p->data.and.f != mpcf_snd) { return NULL; }
+  a = mpc_dfa_strip(p->data.and.xs[0]);
+  if (a->type != MPC_TYPE_ANCHOR || !mpc_dfa_empty(mpc_dfa_strip(p->data.and.xs[1]))) { return NULL; }
+  return a->data.anchor.f;
+}
+
+static int mpc_dfa_first(mpc_parser_t *p, mpc_charset_t *first);
+
+/*
+** Add the bytes a sequence can start with to `first`. Returns whether it
+** can match nothing, or -1 if part of it can't be compiled.
+*/
+static int mpc_dfa_first_seq(mpc_parser_t **xs, int n, mpc_charset_t *first) {
+  int j, e;
+  for (j = 0; j < n; j++) {
+    e = mpc_dfa_first(xs[j], first);
+    if (e != 1) { return e; }
+  }
+  return 1;
+}
+
+static int mpc_dfa_first(mpc_parser_t *p, mpc_charset_t *first) {
+  
+  int j, e, any;
+  mpc_charset_t s;
+  
+  p = mpc_dfa_strip(p);
+  
+  if (mpc_dfa_leaf(p, &s)) { mpc_charset_union(first, &s); return 0; }
+  if (mpc_dfa_empty(p)) { return 1; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return -1; }
+      return mpc_dfa_first_seq(p->data.and.xs, p->data.and.n, first);
+    
+    case MPC_TYPE_OR:
+      any = 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        e = mpc_dfa_first(p->data.or.xs[j], first);
+        if (e < 0) { return -1; }
+        any |= e;
+      }
+      return any;
+    
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return -1; }
+      return mpc_dfa_first(p->data.not.x, first) < 0 ? -1 : 1;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold) { return -1; }
+      if (p->type == MPC_TYPE_COUNT && p->data.repeat.n < 1) { return -1; }
+      e = mpc_dfa_first(p->data.repeat.x, first);
+      return (e < 0 || p->type != MPC_TYPE_MANY) ? e : 1;
+    
+    default: return -1;
+  }
+}
+
+static int mpc_dfa_check(mpc_parser_t *p, mpc_charset_t *follow);
+
+/* Can each part of a sequence followed by `follow` decide from one byte? */
+static int mpc_dfa_check_seq(mpc_parser_t **xs, int n, mpc_charset_t *follow) {
+  
+  int j, e;
+  mpc_charset_t after = *follow, first;
+  
+  for (j = n-1; j >= 0; j--) {
+    if (!mpc_dfa_check(xs[j], &after)) { return 0; }
+    memset(&first, 0, sizeof(mpc_charset_t));
+    e = mpc_dfa_first(xs[j], &first);
+    if (e == 0) { memset(&after, 0, sizeof(mpc_charset_t)); }
+    mpc_charset_union(&after, &first);
+  }
+  
+  return 1;
+}
+
+static int mpc_dfa_check(mpc_parser_t *p, mpc_charset_t *follow) {
+  
+  int j, e;
+  mpc_parser_t *x;
+  mpc_charset_t s, seen;
+  
+  p = mpc_dfa_strip(p);
+  
+  memset(&s, 0, sizeof(mpc_charset_t));
+  e = mpc_dfa_first(p, &s);
+  if (e < 0) { return 0; }
+  if (mpc_dfa_leaf(p, &s) || mpc_dfa_empty(p)) { return 1; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_AND:
+      return mpc_dfa_check_seq(p->data.and.xs, p->data.and.n, follow);
+    
+    case MPC_TYPE_OR:
+      memset(&seen, 0, sizeof(mpc_charset_t));
+      for (j = 0; j < p->data.or.n; j++) {
+        memset(&s, 0, sizeof(mpc_charset_t));
+        if (mpc_dfa_first(p->data.or.xs[j], &s) == 1 && j < p->data.or.n-1) { return 0; }
+        if (mpc_charset_meets(&seen, &s)) { return 0; }
+        mpc_charset_union(&seen, &s);
+        if (!mpc_dfa_check(p->data.or.xs[j], follow)) { return 0; }
+      }
+      return e == 0 || !mpc_charset_meets(&seen, follow);
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      x = p->type == MPC_TYPE_MAYBE ? p->data.not.x : p->data.repeat.x;
+      memset(&s, 0, sizeof(mpc_charset_t));
+      if (mpc_dfa_first(x, &s) != 0) { return 0; }
+      if (p->type != MPC_TYPE_COUNT && mpc_charset_meets(&s, follow)) { return 0; }
+      if (p->type == MPC_TYPE_MAYBE) { return mpc_dfa_check(x, follow); }
+      mpc_charset_union(&s, follow);
+      return mpc_dfa_check(x, &s);
+    
+    default: return 0;
+  }
+}
+
+static int mpc_nfa_add(mpc_nfa_t *m, int type, int out, int out1) {
+  if (m->num == MPC_DFA_NFA_MAX) { return -1; }
+  m->states[m->num].type = type;
+  m->states[m->num].out = out;
+  m->states[m->num].out1 = out1;
+  memset(&m->states[m->num].set, 0, sizeof(mpc_charset_t));
+  return m->num++;
+}
+
+/* Add the states for p, going on to state `next`. Returns the first */
+static int mpc_nfa_build(mpc_nfa_t *m, mpc_parser_t *p, int next) {
+  
+  int j, s, x;
+  
+  if (next < 0) { return -1; }
+  
+  p = mpc_dfa_strip(p);
+  
+  if (mpc_dfa_empty(p)) { return next; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_AND:
+      for (j = p->data.and.n-1; j >= 0; j--) {
+        next = mpc_nfa_build(m, p->data.and.xs[j], next);
+      }
+      return next;
+    
+    case MPC_TYPE_OR:
+      s = mpc_nfa_build(m, p->data.or.xs[p->data.or.n-1], next);
+      for (j = p->data.or.n-2; j >= 0 && s >= 0; j--) {
+        x = mpc_nfa_build(m, p->data.or.xs[j], next);
+        s = x < 0 ? -1 : mpc_nfa_add(m, MPC_NFA_SPLIT, x, s);
+      }
+      return s;
+    
+    case MPC_TYPE_MAYBE:
+      x = mpc_nfa_build(m, p->data.not.x, next);
+      return x < 0 ? -1 : mpc_nfa_add(m, MPC_NFA_SPLIT, x, next);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      s = mpc_nfa_add(m, MPC_NFA_SPLIT, -1, next);
+      x = mpc_nfa_build(m, p->data.repeat.x, s);
+      if (x < 0) { return -1; }
+      m->states[s].out = x;
+      return p->type == MPC_TYPE_MANY ? s : x;
+    
+    case MPC_TYPE_COUNT:
+      for (j = 0; j < p->data.repeat.n; j++) {
+        next = mpc_nfa_build(m, p->data.repeat.x, next);
+      }
+      return next;
+    
+    default:
+      s = mpc_nfa_add(m, MPC_NFA_CHAR, next, -1);
+      if (s >= 0) { mpc_dfa_leaf(p, &m->states[s].set); }
+      return s;
+  }
+}
+
+/* Add state s and everything it reaches without reading a byte to `set` */
+static void mpc_nfa_closure(mpc_nfa_t *m, unsigned char *set, int s, int *stack) {
+  
+  int n = 0;
+  
+  stack[n++] = s;
+  while (n > 0) {
+    s = stack[--n];
+    if (set[s >> 3] & (1 << (s & 7))) { continue; }
+    set[s >> 3] |= (unsigned char)(1 << (s & 7));
+    if (m->states[s].type == MPC_NFA_SPLIT) {
+      stack[n++] = m->states[s].out1;
+      stack[n++] = m->states[s].out;
+    }
+  }
+}
+
+/*
+** Subset construction then Moore's partition refinement. Bytes no part of
+** the regex tells apart share a class, so each state is worked out once
+** per class rather than once per byte.
+*/
+static mpc_dfa_t *mpc_dfa_build(mpc_nfa_t *m, int start, int soi, int eoi) {
+  
+  int j, k, c, s, t, n, old, num = 0, classes = 1;
+  int setlen = (m->num + 7) / 8;
+  int byte_class[256], class_byte[512];
+  int *stack = malloc(sizeof(int) * m->num * 2 + sizeof(int));
+  unsigned char *sets = calloc((size_t)setlen * MPC_DFA_STATES_MAX, 1);
+  unsigned char *move = malloc((size_t)setlen + 1);
+  int *trans = NULL, *part = NULL, *part_next = NULL;
+  char *accept = calloc(MPC_DFA_STATES_MAX, 1);
+  mpc_dfa_t *d = NULL;
+  
+  /* Split every class by each set, then number what is left from 0 */
+  memset(byte_class, 0, sizeof(byte_class));
+  for (j = 0; j < m->num; j++) {
+    if (m->states[j].type != MPC_NFA_CHAR) { continue; }
+    for (k = 0; k < classes * 2; k++) { class_byte[k] = -1; }
+    for (c = 0; c < 256; c++) {
+      if (mpc_charset_has(&m->states[j].set, c)) { byte_class[c] += classes; }
+    }
+    for (c = 0, n = 0; c < 256; c++) {
+      k = byte_class[c];
+      if (class_byte[k] == -1) { class_byte[k] = n++; }
+      byte_class[c] = class_byte[k];
+    }
+    classes = n;
+  }
+  for (k = 0; k < classes; k++) { class_byte[k] = -1; }
+  for (c = 0; c < 256; c++) {
+    if (class_byte[byte_class[c]] == -1) { class_byte[byte_class[c]] = c; }
+  }
   
-  mpc_parser_t *out;
-  size_t i, j;
-  size_t start, end;
-  const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+  trans = malloc(sizeof(int) * MPC_DFA_STATES_MAX * classes);
   
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  /* State 0 is the empty set and 1 the start */
+  num = 2;
+  mpc_nfa_closure(m, sets + setlen, start, stack);
   
-  for (i = comp; i < strlen(s); i++){
-    
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];      
+  for (s = 0; s < num; s++) {
+    for (j = 0; j < m->num; j++) {
+      if ((sets[s * setlen + (j >> 3)] & (1 << (j & 7))) && m->states[j].type == MPC_NFA_MATCH) {
+        accept[s] = 1;
       }
-      i++;
     }
-    
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = (char)j;
-        }        
+    for (k = 0; k < classes; k++) {
+      memset(move, 0, setlen);
+      for (j = 0; j < m->num; j++) {
+        if ((sets[s * setlen + (j >> 3)] & (1 << (j & 7)))
+        &&  m->states[j].type == MPC_NFA_CHAR
+        &&  mpc_charset_has(&m->states[j].set, class_byte[k])) {
+          mpc_nfa_closure(m, move, m->states[j].out, stack);
+        }
+      }
+      for (t = 0; t < num; t++) {
+        if (memcmp(sets + t * setlen, move, setlen) == 0) { break; }
+      }
+      if (t == num) {
+        if (num == MPC_DFA_STATES_MAX) { goto done; }
+        memcpy(sets + num * setlen, move, setlen);
+        num++;
       }
+      trans[s * classes + k] = t;
     }
-    
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
+  }
+  
+  /*
+  ** Minimise, starting from accepting and not. Parts are numbered in order
+  ** of their first state, so the dead part is 0 and the start's is 1
+  ** unless the regex can never match, which is left to the combinators.
+  */
+  part = malloc(sizeof(int) * num);
+  part_next = malloc(sizeof(int) * num);
+  for (s = 0; s < num; s++) { part[s] = accept[s]; }
+  
+  for (old = -1;; old = n) {
+    n = 0;
+    for (s = 0; s < num; s++) {
+      for (t = 0; t < s; t++) {
+        if (part[t] != part[s]) { continue; }
+        for (k = 0; k < classes; k++) {
+          if (part[trans[t * classes + k]] != part[trans[s * classes + k]]) { break; }
+        }
+        if (k == classes) { break; }
+      }
+      part_next[s] = t < s ? part_next[t] : n++;
+    }
+    memcpy(part, part_next, sizeof(int) * num);
+    if (n == old) { break; }
+  }
+  
+  if (part[1] == 0) { goto done; }
+  
+  d = malloc(sizeof(mpc_dfa_t));
+  d->refs = 1;
+  d->states_num = n;
+  d->soi = soi;
+  d->eoi = eoi;
+  d->accept = calloc(n, 1);
+  d->next = malloc(sizeof(unsigned short) * n * 256);
+  for (s = 0; s < num; s++) {
+    d->accept[part[s]] = accept[s];
+    for (c = 0; c < 256; c++) {
+      d->next[part[s] * 256 + c] = (unsigned short)part[trans[s * classes + byte_class[c]]];
     }
+  }
   
+done:
+  free(stack);
+  free(sets);
+  free(move);
+  free(trans);
+  free(part);
+  free(part_next);
+  free(accept);
+  return d;
+}
+
+static mpc_dfa_t *mpc_dfa_new(mpc_parser_t *p) {
+  
+  int n, start, soi = 0, eoi = 0;
+  mpc_parser_t **xs;
+  mpc_charset_t follow;
+  mpc_nfa_t *m;
+  mpc_dfa_t *d;
+  
+  p = mpc_dfa_strip(p);
+  if (p->type == MPC_TYPE_AND && p->data.and.f == mpcf_strfold) {
+    xs = p->data.and.xs;
+    n = p->data.and.n;
+  } else {
+    xs = &p;
+    n = 1;
   }
   
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  if (n > 0 && mpc_dfa_anchor(xs[0]) == mpc_soi_anchor) { soi = 1; xs++; n--; }
+  if (n > 0 && mpc_dfa_anchor(xs[n-1]) == mpc_eoi_anchor) { eoi = 1; n--; }
   
-  free(x);
-  free(range);
+  memset(&follow, 0, sizeof(mpc_charset_t));
+  if (!mpc_dfa_check_seq(xs, n, &follow)) { return NULL; }
   
-  return out;
+  m = malloc(sizeof(mpc_nfa_t));
+  m->num = 0;
+  start = mpc_nfa_add(m, MPC_NFA_MATCH, -1, -1);
+  for (n = n-1; n >= 0; n--) {
+    start = mpc_nfa_build(m, xs[n], start);
+  }
+  
+  d = start < 0 ? NULL : mpc_dfa_build(m, start, soi, eoi);
+  free(m);
+  return d;
+}
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  if (--d->refs > 0) { return; }
+  free(d->accept);
+  free(d->next);
+  free(d);
+}
+
+/* Use a DFA for the regex p when it gives the same matches */
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *p) {
+  
+  mpc_dfa_t *d = mpc_dfa_new(p);
+  mpc_parser_t *q;
+  
+  if (d == NULL) { return p; }
+  
+  q = mpc_undefined();
+  q->type = MPC_TYPE_DFA;
+  q->data.dfa.x = p;
+  q->data.dfa.d = d;
+  return q;
 }
 
 mpc_parser_t *mpc_re(const char *re) {
@@ -2219,7 +3986,7 @@ mpc_parser_t *mpc_re(const char *re) {
   
   mpc_optimise(r.output);
   
-  return r.output;
+  return mpc_re_dfa(r.output);
   
 }
 
@@ -2442,16 +4209,20 @@ mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2)
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
   int i;
-  size_t l = 0;
+  size_t l = 0, m;
   
   if (n == 0) { return calloc(1, 1); }
   
   for (i = 0; i < n; i++) { l += strlen(xs[i]); }
   
   xs[0] = realloc(xs[0], l + 1);
+  l = strlen(xs[0]);
   
   for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
+    m = strlen(xs[i]);
+    memcpy((char*)xs[0] + l, xs[i], m + 1);
+    l += m;
+    free(xs[i]);
   }
   
   return xs[0];
@@ -2560,6 +4331,9 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { mpc_print_unretained(p->data.span.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2665,6 +4439,62 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+/*
+** Tag ids. Each distinct tag name is interned once, when the parsers
+** using it are built, so parsing itself only ever handles integers and
+** never touches this table.
+*/
+
+static char **mpc_tag_names = NULL;
+static int mpc_tag_count = 0;
+static int mpc_tag_slots = 0;
+
+static int mpc_tag_intern_n(const char *name, size_t n) {
+  
+  int i;
+  
+  if (mpc_tag_count == 0) {
+    mpc_tag_slots = 16;
+    mpc_tag_names = malloc(sizeof(char*) * mpc_tag_slots);
+    mpc_tag_names[MPC_TAG_ROOT] = malloc(2);
+    strcpy(mpc_tag_names[MPC_TAG_ROOT], ">");
+    mpc_tag_count = 1;
+  }
+  
+  for (i = 0; i < mpc_tag_count; i++) {
+    if (strncmp(mpc_tag_names[i], name, n) == 0 && mpc_tag_names[i][n] == '\0') { return i; }
+  }
+  
+  if (mpc_tag_count == mpc_tag_slots) {
+    mpc_tag_slots *= 2;
+    mpc_tag_names = realloc(mpc_tag_names, sizeof(char*) * mpc_tag_slots);
+  }
+  
+  mpc_tag_names[mpc_tag_count] = malloc(n + 1);
+  memcpy(mpc_tag_names[mpc_tag_count], name, n);
+  mpc_tag_names[mpc_tag_count][n] = '\0';
+  return mpc_tag_count++;
+}
+
+int mpc_tag_id(const char *name) {
+  return mpc_tag_intern_n(name, strlen(name));
+}
+
+const char *mpc_tag_name(int id) {
+  if (id == MPC_TAG_ROOT) { return ">"; }
+  if (id < 0 || id >= mpc_tag_count) { return ""; }
+  return mpc_tag_names[id];
+}
+
+/*
+** AST
+*/
+
+static void mpc_ast_free_tags(mpc_ast_t *a) {
+  if (a->tags != a->tags_inline) { free(a->tags); }
+  free(a->tag);
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
   
   int i;
@@ -2676,29 +4506,88 @@ void mpc_ast_delete(mpc_ast_t *a) {
   }
   
   free(a->children);
-  free(a->tag);
+  mpc_ast_free_tags(a);
   free(a->contents);
+  if (a->source) { mpc_source_release(a->source); }
   free(a);
   
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
-  free(a->tag);
+  mpc_ast_free_tags(a);
   free(a->contents);
+  if (a->source) { mpc_source_release(a->source); }
   free(a);
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+/* Tags are stored innermost first, so wrapping a node in a rule appends */
+static mpc_ast_t *mpc_ast_push_tag(mpc_ast_t *a, int id) {
+  
+  if (a->tags_num == MPC_AST_TAGS_INLINE && a->tags == a->tags_inline) {
+    a->tags = malloc(sizeof(int) * MPC_AST_TAGS_INLINE * 2);
+    memcpy(a->tags, a->tags_inline, sizeof(int) * MPC_AST_TAGS_INLINE);
+  } else if (a->tags_num > MPC_AST_TAGS_INLINE
+  &&        (a->tags_num & (a->tags_num - 1)) == 0) {
+    a->tags = realloc(a->tags, sizeof(int) * a->tags_num * 2);
+  }
+  
+  a->tags[a->tags_num++] = id;
+  
+  free(a->tag);
+  a->tag = NULL;
+  return a;
+}
+
+/* Push the '|' separated names in t, outermost first, onto a */
+static mpc_ast_t *mpc_ast_push_tag_str(mpc_ast_t *a, const char *t) {
+  size_t i, j = strlen(t);
+  for (;;) {
+    for (i = j; i > 0 && t[i-1] != '|'; i--);
+    mpc_ast_push_tag(a, mpc_tag_intern_n(t + i, j - i));
+    if (i == 0) { return a; }
+    j = i - 1;
+  }
+}
+
+static mpc_ast_t *mpc_ast_new_id(int id, const char *contents) {
   
   mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
   
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  a->tag = NULL;
+  a->tags = a->tags_inline;
+  a->tags_num = 0;
+  if (id >= 0) { a->tags[a->tags_num++] = id; }
   
   a->contents = malloc(strlen(contents) + 1);
   strcpy(a->contents, contents);
   
+  a->source = NULL;
+  a->offset = 0;
+  a->length = 0;
+  
+  a->state = mpc_state_new();
+  
+  a->children_num = 0;
+  a->children = NULL;
+  return a;
+  
+}
+
+static mpc_ast_t *mpc_ast_new_slice(mpc_source_t *s, long offset, long length) {
+  
+  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  
+  a->tag = NULL;
+  a->tags = a->tags_inline;
+  a->tags_num = 0;
+  
+  a->contents = NULL;
+  a->source = s;
+  a->offset = offset;
+  a->length = length;
+  s->refs++;
+  
   a->state = mpc_state_new();
   
   a->children_num = 0;
@@ -2707,6 +4596,12 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
 }
 
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  mpc_ast_t *a = mpc_ast_new_id(-1, contents);
+  if (tag[0] != '\0') { mpc_ast_push_tag_str(a, tag); }
+  return a;
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
   
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -2733,7 +4628,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_id(MPC_TAG_ROOT, "");
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2741,9 +4636,14 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   
   int i;
-
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
-  if (strcmp(a->contents, b->contents) != 0) { return 0; }
+  const char *ac, *bc;
+  size_t al, bl;
+
+  if (a->tags_num != b->tags_num) { return 0; }
+  if (memcmp(a->tags, b->tags, sizeof(int) * a->tags_num) != 0) { return 0; }
+  ac = mpc_ast_get_slice(a, &al);
+  bc = mpc_ast_get_slice(b, &bl);
+  if (al != bl || memcmp(ac, bc, al) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
   
   for (i = 0; i < a->children_num; i++) {
@@ -2753,6 +4653,40 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   return 1;
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i, n;
+  mpc_ast_t *b;
+  
+  if (a == NULL) { return NULL; }
+  
+  b = malloc(sizeof(mpc_ast_t));
+  *b = *a;
+  b->tag = NULL;
+  
+  /* Heap tags keep room to grow by doubling, as mpc_ast_push_tag expects */
+  if (a->tags_num <= MPC_AST_TAGS_INLINE) {
+    b->tags = b->tags_inline;
+  } else {
+    for (n = MPC_AST_TAGS_INLINE * 2; n < a->tags_num; n *= 2);
+    b->tags = malloc(sizeof(int) * n);
+  }
+  memcpy(b->tags, a->tags, sizeof(int) * a->tags_num);
+  
+  if (a->contents) {
+    b->contents = malloc(strlen(a->contents) + 1);
+    strcpy(b->contents, a->contents);
+  }
+  if (a->source) { a->source->refs++; }
+  
+  b->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = mpc_ast_copy(a->children[i]);
+  }
+  
+  return b;
+}
+
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
   r->children_num++;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
@@ -2762,25 +4696,100 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
+  return mpc_ast_push_tag_str(a, t);
+}
+
+/* Give a the tags of its parent r, minus the ">" marking r as a root */
+static mpc_ast_t *mpc_ast_add_root_tags(mpc_ast_t *a, mpc_ast_t *r) {
+  int i;
+  for (i = 1; i < r->tags_num; i++) {
+    mpc_ast_push_tag(a, r->tags[i]);
+  }
   return a;
 }
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
+  mpc_ast_t *r;
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
-  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, (strlen(t)-1));
+  r = mpc_ast_new(t, "");
+  mpc_ast_add_root_tags(a, r);
+  mpc_ast_delete(r);
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
-  return a;
+  if (a == NULL) { return a; }
+  a->tags_num = 0;
+  if (t[0] == '\0') {
+    free(a->tag);
+    a->tag = NULL;
+    return a;
+  }
+  return mpc_ast_push_tag_str(a, t);
+}
+
+static mpc_val_t *mpcf_ast_tag_id(mpc_val_t *x, void *id) {
+  mpc_ast_t *a = x;
+  if (a == NULL) { return a; }
+  a->tags_num = 0;
+  return mpc_ast_push_tag(a, (int)(size_t)id);
+}
+
+static mpc_val_t *mpcf_ast_add_tag_id(mpc_val_t *x, void *id) {
+  if (x == NULL) { return x; }
+  return mpc_ast_push_tag(x, (int)(size_t)id);
+}
+
+const char *mpc_ast_get_tag(mpc_ast_t *a) {
+  
+  int i;
+  size_t n = 0;
+  
+  if (a->tag) { return a->tag; }
+  
+  for (i = 0; i < a->tags_num; i++) {
+    n += strlen(mpc_tag_name(a->tags[i])) + 1;
+  }
+  
+  a->tag = malloc(n + 1);
+  a->tag[0] = '\0';
+  n = 0;
+  
+  for (i = a->tags_num-1; i >= 0; i--) {
+    const char *name = mpc_tag_name(a->tags[i]);
+    size_t l = strlen(name);
+    memcpy(a->tag + n, name, l);
+    n += l;
+    if (i) { a->tag[n++] = '|'; }
+  }
+  
+  a->tag[n] = '\0';
+  return a->tag;
+}
+
+const char *mpc_ast_get_contents(mpc_ast_t *a) {
+  if (a->contents) { return a->contents; }
+  a->contents = malloc(a->length + 1);
+  memcpy(a->contents, a->source->text + a->offset, a->length);
+  a->contents[a->length] = '\0';
+  return a->contents;
+}
+
+const char *mpc_ast_get_slice(mpc_ast_t *a, size_t *length) {
+  if (a->source) {
+    *length = a->length;
+    return a->source->text + a->offset;
+  }
+  *length = strlen(a->contents);
+  return a->contents;
+}
+
+int mpc_ast_has_tag(mpc_ast_t *a, int id) {
+  int i;
+  for (i = 0; i < a->tags_num; i++) {
+    if (a->tags[i] == id) { return 1; }
+  }
+  return 0;
 }
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
@@ -2792,6 +4801,8 @@ mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
 static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
   
   int i;
+  const char *c;
+  size_t l;
   
   if (a == NULL) {
     fprintf(fp, "NULL\n");
@@ -2800,13 +4811,14 @@ static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
   
   for (i = 0; i < d; i++) { fprintf(fp, "  "); }
   
-  if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag, 
+  c = mpc_ast_get_slice(a, &l);
+  if (l) {
+    fprintf(fp, "%s:%lu:%lu '%.*s'\n", mpc_ast_get_tag(a), 
       (long unsigned int)(a->state.row+1),
       (long unsigned int)(a->state.col+1),
-      a->contents);
+      (int)l, c);
   } else {
-    fprintf(fp, "%s \n", a->tag);
+    fprintf(fp, "%s \n", mpc_ast_get_tag(a));
   }
   
   for (i = 0; i < a->children_num; i++) {
@@ -2831,7 +4843,7 @@ int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
   int i;
 
   for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
+    if(strcmp(mpc_ast_get_tag(ast->children[i]), tag) == 0) {
       return i;
     }
   }
@@ -2847,7 +4859,7 @@ mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
   int i;
 
   for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
+    if(strcmp(mpc_ast_get_tag(ast->children[i]), tag) == 0) {
       return ast->children[i];
     }
   }
@@ -3002,7 +5014,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
   
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_id(MPC_TAG_ROOT, "");
   
   for (i = 0; i < n; i++) {
     
@@ -3011,7 +5023,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     if        (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      mpc_ast_add_child(r, mpc_ast_add_root_tags(as[i]->children[0], as[i]));
       mpc_ast_delete_no_children(as[i]);
     } else if (as[i] && as[i]->children_num >= 2) {
       for (j = 0; j < as[i]->children_num; j++) {
@@ -3049,11 +5061,11 @@ mpc_parser_t *mpca_state(mpc_parser_t *a) {
 }
 
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+  return mpc_apply_to(a, mpcf_ast_tag_id, (void*)(size_t)mpc_tag_id(t));
 }
 
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+  return mpc_apply_to(a, mpcf_ast_add_tag_id, (void*)(size_t)mpc_tag_id(t));
 }
 
 mpc_parser_t *mpca_root(mpc_parser_t *a) {
@@ -3113,6 +5125,7 @@ mpc_parser_t *mpca_and(int n, ...) {
 }
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_memo(mpc_parser_t *a) { return mpc_memo(a, (mpc_copy_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete); }
 
 /*
 ** Grammar Parser
@@ -3429,6 +5442,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_MEMO) { stmt->grammar = mpca_memo(stmt->grammar); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
@@ -3623,6 +5637,9 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { return 1 + mpc_nodecount_unretained(p->data.span.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
@@ -3655,12 +5672,190 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Stats\n");
   printf("=====\n");
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  printf("Pool Hits: %lu\n", mpc_mem_total_hits);
+  printf("Pool Misses: %lu\n", mpc_mem_total_misses);
+  printf("Pool Peak: %lu bytes\n", (unsigned long)mpc_mem_total_peak);
+}
+
+/*
+** The span for a repeat of one character class, or NULL. Every parser down
+** to the class has to be unretained, as redefining one would otherwise
+** leave the span scanning for the old class.
+*/
+static mpc_span_t *mpc_span_new(mpc_parser_t *p) {
+  
+  int c, lo, n = 0;
+  mpc_parser_t *x;
+  mpc_span_t *s;
+  
+  if (p->type != MPC_TYPE_MANY && p->type != MPC_TYPE_MANY1) { return NULL; }
+  if (p->data.repeat.f != mpcf_strfold) { return NULL; }
+  
+  x = p->data.repeat.x;
+  while (!x->retained && x->type == MPC_TYPE_EXPECT) { x = x->data.expect.x; }
+  if (x->retained) { return NULL; }
+  
+  s = malloc(sizeof(mpc_span_t));
+  if (!mpc_dfa_leaf(x, &s->set)) { free(s); return NULL; }
+  s->min = p->type == MPC_TYPE_MANY1;
+  
+  for (c = 0; c < 256 && n >= 0; c++) {
+    if (!mpc_charset_has(&s->set, c)) { continue; }
+    for (lo = c; c < 255 && mpc_charset_has(&s->set, c+1); c++);
+    if (n == MPC_SPAN_RANGES) { n = -1; break; }
+    s->lo[n] = (unsigned char)lo;
+    s->hi[n] = (unsigned char)c;
+    n++;
+  }
+  s->ranges_num = n < 0 ? 0 : n;
+  
+  return s;
+}
+
+/*
+** Add the bytes p can start with to `first`. Returns 0 if p has to read
+** one of them to succeed, 1 if it can succeed without reading anything,
+** or -1 if that can't be known, as for a parser that may be redefined.
+*/
+static int mpc_jump_first(mpc_parser_t *p, mpc_charset_t *first);
+
+static int mpc_jump_first_seq(mpc_parser_t **xs, int n, mpc_charset_t *first) {
+  int j, e;
+  for (j = 0; j < n; j++) {
+    e = mpc_jump_first(xs[j], first);
+    if (e != 1) { return e; }
+  }
+  return 1;
+}
+
+static int mpc_jump_first(mpc_parser_t *p, mpc_charset_t *first) {
+  
+  int j, e, any;
+  mpc_charset_t s;
+  
+  if (p->retained) { return -1; }
+  if (mpc_dfa_leaf(p, &s)) { mpc_charset_union(first, &s); return 0; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return 1; }
+      mpc_charset_add(first, (unsigned char)p->data.string.x[0]);
+      return 0;
+    
+    case MPC_TYPE_FAIL: return 0;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_NOT: return 1;
+    
+    case MPC_TYPE_EXPECT:   return mpc_jump_first(p->data.expect.x, first);
+    case MPC_TYPE_APPLY:    return mpc_jump_first(p->data.apply.x, first);
+    case MPC_TYPE_APPLY_TO: return mpc_jump_first(p->data.apply_to.x, first);
+    case MPC_TYPE_PREDICT:  return mpc_jump_first(p->data.predict.x, first);
+    case MPC_TYPE_MEMO:     return mpc_jump_first(p->data.memo.x, first);
+    case MPC_TYPE_DFA:      return mpc_jump_first(p->data.dfa.x, first);
+    case MPC_TYPE_SPAN:     return mpc_jump_first(p->data.span.x, first);
+    
+    case MPC_TYPE_MAYBE:
+      return mpc_jump_first(p->data.not.x, first) < 0 ? -1 : 1;
+    
+    case MPC_TYPE_MANY:
+      return mpc_jump_first(p->data.repeat.x, first) < 0 ? -1 : 1;
+    
+    case MPC_TYPE_MANY1:
+      return mpc_jump_first(p->data.repeat.x, first);
+    
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n < 1) { return 1; }
+      return mpc_jump_first(p->data.repeat.x, first);
+    
+    case MPC_TYPE_OR:
+      any = 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        e = mpc_jump_first(p->data.or.xs[j], first);
+        if (e < 0) { return -1; }
+        any |= e;
+      }
+      return any;
+    
+    case MPC_TYPE_AND:
+      return mpc_jump_first_seq(p->data.and.xs, p->data.and.n, first);
+    
+    default: return -1;
+  }
+}
+
+/* The jump table for an `or`, or NULL if every byte would try them all */
+static mpc_jump_t *mpc_jump_new(mpc_parser_t *p) {
+  
+  int j, c, k, m, len = 0, skips = 0;
+  int n = p->data.or.n;
+  int *kind = malloc(sizeof(int) * n);
+  int *list = malloc(sizeof(int) * (n + 1));
+  mpc_charset_t *first = calloc(n, sizeof(mpc_charset_t));
+  mpc_jump_t *d = malloc(sizeof(mpc_jump_t));
+  
+  d->refs = 1;
+  d->alts = malloc(sizeof(int) * (n + 1) * 257);
+  
+  for (j = 0; j < n; j++) {
+    kind[j] = mpc_jump_first(p->data.or.xs[j], &first[j]);
+  }
+  
+  for (c = 0; c < 257; c++) {
+    
+    m = 1;
+    for (j = 0; j < n; j++) {
+      if (kind[j] != 0 || (c < 256 && mpc_charset_has(&first[j], c))) { list[m++] = j; }
+    }
+    list[0] = m - 1;
+    if (m - 1 < n) { skips = 1; }
+    
+    for (k = 0; k < len; k += d->alts[k] + 1) {
+      if (d->alts[k] == list[0] && memcmp(d->alts + k, list, sizeof(int) * m) == 0) { break; }
+    }
+    if (k == len) {
+      memcpy(d->alts + len, list, sizeof(int) * m);
+      len += m;
+    }
+    d->start[c] = k;
+  }
+  
+  free(kind);
+  free(list);
+  free(first);
+  
+  if (!skips) {
+    free(d->alts);
+    free(d);
+    return NULL;
+  }
+  
+  d->alts = realloc(d->alts, sizeof(int) * len);
+  return d;
+}
+
+static void mpc_jump_delete(mpc_jump_t *d) {
+  if (--d->refs > 0) { return; }
+  free(d->alts);
+  free(d);
+}
+
+static void mpc_jump_clear(mpc_parser_t *p) {
+  if (p->data.or.jump == NULL) { return; }
+  mpc_jump_delete(p->data.or.jump);
+  p->data.or.jump = NULL;
 }
 
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   
   int i, n, m;
   mpc_parser_t *t;
+  mpc_span_t *s;
   
   if (p->retained && !force) { return; }
   
@@ -3670,6 +5865,9 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_optimise_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_optimise_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_optimise_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_optimise_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { mpc_optimise_unretained(p->data.span.x, 0); }
   if (p->type == MPC_TYPE_NOT)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)    { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0); }
@@ -3701,6 +5899,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      mpc_jump_clear(p); mpc_jump_clear(t);
       free(t->data.or.xs); free(t->name); free(t);
       continue;
     }
@@ -3715,6 +5914,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, t->data.or.xs + 1, n * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      mpc_jump_clear(p); mpc_jump_clear(t);
       free(t->data.or.xs); free(t->name); free(t);
       continue;
     }
@@ -3818,6 +6018,33 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
     
+    /* Give class `oneof` and `noneof` a bitmap */
+    if ((p->type == MPC_TYPE_ONEOF || p->type == MPC_TYPE_NONEOF)
+    &&  p->data.string.set == NULL) {
+      p->data.string.set = malloc(sizeof(mpc_charset_t));
+      mpc_dfa_leaf(p, p->data.string.set);
+      continue;
+    }
+    
+    /* Scan class `many` as a span */
+    if (!p->retained && (s = mpc_span_new(p)) != NULL) {
+      t = mpc_undefined();
+      memcpy(t, p, sizeof(mpc_parser_t));
+      t->name = NULL;
+      p->type = MPC_TYPE_SPAN;
+      p->data.span.x = t;
+      p->data.span.s = s;
+      continue;
+    }
+    
+    /* Dispatch `or` on the next byte */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.n > 1
+    &&  p->data.or.jump == NULL
+    && (p->data.or.jump = mpc_jump_new(p)) != NULL) {
+      continue;
+    }
+    
     return;
     
   }
@@ -3825,6 +6052,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
 }
 
 void mpc_optimise(mpc_parser_t *p) {
+  mpc_slice_gen++;
   mpc_optimise_unretained(p, 1);
 }
 
@@ -70,12 +70,32 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Like mpc_parse and mpc_nparse, but AST leaves made by mpcf_str_ast point
+** into a shared copy of the input instead of owning their contents. Read
+** them with mpc_ast_get_slice or mpc_ast_get_contents.
+*/
+
+int mpc_parse_slices(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_nparse_slices(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+
+/*
+** Parsers nest on a stack of their own rather than the C stack. A parser
+** nested more than mpc_depth_budget deep (MPC_DEPTH_BUDGET by default)
+** fails with "Parser nesting too deep!" instead of overflowing it.
+*/
+
+enum { MPC_DEPTH_BUDGET = 256 * 1024 };
+
+void mpc_depth_budget(int depth);
+
 /*
 ** Function Types
 */
 
 typedef void(*mpc_dtor_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_ctor_t)(void);
+typedef mpc_val_t*(*mpc_copy_t)(mpc_val_t*);
 
 typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
@@ -140,6 +160,22 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
 
+/*
+** Memoisation
+**
+** mpc_memo remembers what `a` gave at each position it was tried at, for
+** the length of one parse, so backtracking into it again costs a copy
+** instead of a reparse. Results are stored and handed out as copies made
+** with `cp`, and freed with `da`. A parse keeps at most mpc_memo_budget
+** bytes of them (MPC_MEMO_BUDGET by default), dropping the least recently
+** used first. Only string input is memoised.
+*/
+
+enum { MPC_MEMO_BUDGET = 4 * 1024 * 1024 };
+
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_copy_t cp, mpc_dtor_t da);
+void mpc_memo_budget(size_t bytes);
+
 /*
 ** Common Parsers
 */
@@ -261,14 +297,44 @@ mpc_parser_t *mpc_re(const char *re);
 ** AST
 */
 
+/*
+** Tag names are interned into small integer ids. Nodes carry the ids of
+** every rule that produced them, innermost first, and only build the
+** "expr|number|regex" style string when mpc_ast_get_tag or mpc_ast_print
+** asks for it.
+**
+** Unlike upstream mpc, `tag` is NULL until one of those fills it in.
+** Code that read ast->tag directly must call mpc_ast_get_tag instead,
+** or test ids from mpc_tag_id with mpc_ast_has_tag.
+*/
+
+enum { MPC_TAG_ROOT = 0, MPC_AST_TAGS_INLINE = 4 };
+
+/*
+** Leaves from mpc_parse_slices are (offset, length) slices of `source`,
+** which they keep alive, and their `contents` is NULL until
+** mpc_ast_get_contents asks for it. Other nodes have no source.
+*/
+
+struct mpc_source_t;
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  int tags_num;
+  int *tags;
+  int tags_inline[MPC_AST_TAGS_INLINE];
+  struct mpc_source_t *source;
+  long offset;
+  long length;
 } mpc_ast_t;
 
+int mpc_tag_id(const char *name);
+const char *mpc_tag_name(int id);
+
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
@@ -276,6 +342,10 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
+const char *mpc_ast_get_tag(mpc_ast_t *a);
+const char *mpc_ast_get_contents(mpc_ast_t *a);
+const char *mpc_ast_get_slice(mpc_ast_t *a, size_t *length);
+int mpc_ast_has_tag(mpc_ast_t *a, int id);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
 void mpc_ast_delete(mpc_ast_t *a);
@@ -310,6 +380,7 @@ void mpc_ast_traverse_free(mpc_ast_trav_t **trav);
 ** Warning: This function currently doesn't test for equality of the `state` member!
 */
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
@@ -320,6 +391,7 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
@@ -334,7 +406,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_MEMO                 = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
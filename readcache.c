@@ -0,0 +1,247 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * LRU cache of read input, see readcache.h
+ *
+ * Entries live in a chained hash table keyed by a 64 bit FNV-1a hash of
+ * the input, and on a doubly linked list from most to least recently
+ * used. The full input is kept alongside each entry, so a hash collision
+ * can never return the wrong expression.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpc.h"
+#include "rrb.h"
+#include "hamt.h"
+#include "lstr.h"
+#include "lispy.h"
+#include "readcache.h"
+
+typedef struct entry {
+    uint64_t hash;
+    char *input;
+    size_t len;
+    lval *value;
+    size_t bytes;
+    struct entry *chain;    /* next in the same bucket */
+    struct entry *newer;
+    struct entry *older;
+} entry;
+
+struct read_cache {
+    entry **buckets;
+    size_t nbuckets;
+    entry *newest;
+    entry *oldest;
+    read_cache_stats stats;
+};
+
+static uint64_t hash_input(const char *input, size_t len) {
+    uint64_t h = 14695981039346656037u;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)input[i]) * 1099511628211u;
+    }
+    return h;
+}
+
+/* rough heap footprint of x, walking lists without recursing */
+static size_t lval_bytes(lval *x) {
+    lval **stack = NULL;
+    size_t depth = 0;
+    size_t cap = 0;
+    size_t n = 0;
+
+    for (;;) {
+        n += sizeof(lval);
+        switch (x->type) {
+            case LVAL_ERR:
+                n += strlen(x->err) + 1;
+                break;
+
+            case LVAL_SYM:
+                n += strlen(x->sym) + 1;
+                break;
+
+            case LVAL_STR:
+                n += x->str.tag == LSTR_HEAP ? lstr_len(&x->str) + 1 : 0;
+                break;
+
+            case LVAL_SEXPR:
+                n += sizeof(lval*) * x->count;
+                if (x->count == 0) {
+                    break;
+                }
+                if (depth + x->count > cap) {
+                    cap = (depth + x->count) * 2;
+                    stack = realloc(stack, sizeof(lval*) * cap);
+                }
+                memcpy(stack + depth, x->cell, sizeof(lval*) * x->count);
+                depth += x->count;
+                break;
+        }
+        if (depth == 0) {
+            break;
+        }
+        x = stack[--depth];
+    }
+    free(stack);
+    return n;
+}
+
+read_cache* read_cache_new(size_t budget) {
+    read_cache *c = calloc(1, sizeof(read_cache));
+    c->nbuckets = 64;
+    c->buckets = calloc(c->nbuckets, sizeof(entry*));
+    c->stats.budget = budget;
+    return c;
+}
+
+static void entry_free(entry *e) {
+    lval_del(e->value);
+    free(e->input);
+    free(e);
+}
+
+void read_cache_delete(read_cache *c) {
+    entry *e = c->newest;
+    while (e) {
+        entry *next = e->older;
+        entry_free(e);
+        e = next;
+    }
+    free(c->buckets);
+    free(c);
+}
+
+static void lru_unlink(read_cache *c, entry *e) {
+    if (e->newer) {
+        e->newer->older = e->older;
+    } else {
+        c->newest = e->older;
+    }
+    if (e->older) {
+        e->older->newer = e->newer;
+    } else {
+        c->oldest = e->newer;
+    }
+}
+
+static void lru_push(read_cache *c, entry *e) {
+    e->newer = NULL;
+    e->older = c->newest;
+    if (c->newest) {
+        c->newest->newer = e;
+    } else {
+        c->oldest = e;
+    }
+    c->newest = e;
+}
+
+static entry** bucket_of(read_cache *c, uint64_t hash) {
+    return &c->buckets[hash & (c->nbuckets - 1)];
+}
+
+static void evict_oldest(read_cache *c) {
+    entry *e = c->oldest;
+    entry **p = bucket_of(c, e->hash);
+    while (*p != e) {
+        p = &(*p)->chain;
+    }
+    *p = e->chain;
+    lru_unlink(c, e);
+
+    c->stats.entries--;
+    c->stats.bytes -= e->bytes;
+    c->stats.evictions++;
+    entry_free(e);
+}
+
+static void grow(read_cache *c) {
+    size_t n = c->nbuckets * 2;
+    entry **buckets = calloc(n, sizeof(entry*));
+    for (size_t i = 0; i < c->nbuckets; ++i) {
+        entry *e = c->buckets[i];
+        while (e) {
+            entry *next = e->chain;
+            entry **b = &buckets[e->hash & (n - 1)];
+            e->chain = *b;
+            *b = e;
+            e = next;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = n;
+}
+
+lval* read_cache_get(read_cache *c, const char *input, size_t len) {
+    if (len < READ_CACHE_MIN) {
+        return NULL;
+    }
+    uint64_t hash = hash_input(input, len);
+    for (entry *e = *bucket_of(c, hash); e; e = e->chain) {
+        if (e->hash == hash && e->len == len && memcmp(e->input, input, len) == 0) {
+            lru_unlink(c, e);
+            lru_push(c, e);
+            c->stats.hits++;
+            return e->value;
+        }
+    }
+    c->stats.misses++;
+    return NULL;
+}
+
+void read_cache_put(read_cache *c, const char *input, size_t len, lval *x) {
+    if (len < READ_CACHE_MIN) {
+        return;
+    }
+    size_t bytes = sizeof(entry) + len + lval_bytes(x);
+    if (bytes > c->stats.budget) {
+        return;
+    }
+
+    uint64_t hash = hash_input(input, len);
+    for (entry *e = *bucket_of(c, hash); e; e = e->chain) {
+        if (e->hash == hash && e->len == len && memcmp(e->input, input, len) == 0) {
+            return;
+        }
+    }
+
+    while (c->stats.bytes + bytes > c->stats.budget) {
+        evict_oldest(c);
+    }
+    if (c->stats.entries == c->nbuckets) {
+        grow(c);
+    }
+
+    entry *e = malloc(sizeof(entry));
+    e->hash = hash;
+    e->input = malloc(len ? len : 1);
+    memcpy(e->input, input, len);
+    e->len = len;
+    e->value = lval_copy(x);
+    e->bytes = bytes;
+
+    entry **b = bucket_of(c, hash);
+    e->chain = *b;
+    *b = e;
+    lru_push(c, e);
+
+    c->stats.entries++;
+    c->stats.bytes += bytes;
+}
+
+read_cache_stats read_cache_get_stats(read_cache *c) {
+    return c->stats;
+}
+
+void read_cache_set_budget(read_cache *c, size_t budget) {
+    c->stats.budget = budget;
+    while (c->stats.bytes > budget) {
+        evict_oldest(c);
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Cache of read input.
+ *
+ * Maps the exact text of an input to the lval it read to, so input seen
+ * before skips the reader entirely. Entries are evicted least recently
+ * used first once the bytes held exceed the budget. Only successful reads
+ * are cached, since syntax errors carry the position they were found at.
+ *
+ * The budget starts at READ_CACHE_BUDGET bytes unless lispy is run with
+ * LISPY_READ_CACHE_BUDGET set, and (cache-budget n) changes it later.
+ *
+ * Inputs shorter than READ_CACHE_MIN are not cached at all. For those,
+ * hashing the input and copying the lval costs about as much as reading
+ * it again.
+ *
+ * Requires mpc.h, rrb.h, hamt.h, lstr.h and lispy.h to be included first.
+ */
+
+#ifndef READCACHE_H
+#define READCACHE_H
+
+#include <stddef.h>
+
+#define READ_CACHE_BUDGET   (8 * 1024 * 1024)
+#define READ_CACHE_MIN      256
+
+typedef struct read_cache read_cache;
+
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+} read_cache_stats;
+
+read_cache* read_cache_new(size_t budget);
+void read_cache_delete(read_cache *c);
+
+/*
+ * What input read to, or NULL if it isn't cached. The lval stays the
+ * cache's and is valid until the next put or budget change, so copy it
+ * before changing it.
+ */
+lval* read_cache_get(read_cache *c, const char *input, size_t len);
+
+/* remember that input read to x, which is copied and stays the caller's */
+void read_cache_put(read_cache *c, const char *input, size_t len, lval *x);
+
+read_cache_stats read_cache_get_stats(read_cache *c);
+
+/* evicts least recently used entries until the cache fits the new budget */
+void read_cache_set_budget(read_cache *c, size_t budget);
+
+#endif /* READCACHE_H */
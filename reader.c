@@ -0,0 +1,702 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Single pass S-expression reader, see reader.h
+ *
+ * Mirrors the grammar token by token, including its quirks: a number is
+ * tried before a symbol at every position and there is no required
+ * separator between tokens, so "5-3" reads as 5 and -3 just like it does
+ * through mpc. Open lists are kept on an explicit stack rather than the
+ * C stack.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpc.h"
+#include "rrb.h"
+#include "hamt.h"
+#include "lstr.h"
+#include "lispy.h"
+#include "lnum.h"
+#include "reader.h"
+
+/* nesting handled without touching the heap */
+#define READER_STACK    64
+
+/* character classes */
+#define C_SPACE     1
+#define C_DIGIT     2
+#define C_SYMBOL    4
+
+static unsigned char char_class[256];
+
+static void char_class_init(void) {
+    const char *sym = "abcdefghijklmnopqrstuvwxyz"
+                      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                      "0123456789_+-*/\\=<>!&%";
+    const char *space = " \f\n\r\t\v";
+
+    for (const char *c = sym; *c; ++c) {
+        char_class[(unsigned char)*c] |= C_SYMBOL;
+    }
+    for (const char *c = space; *c; ++c) {
+        char_class[(unsigned char)*c] |= C_SPACE;
+    }
+    for (int c = '0'; c <= '9'; ++c) {
+        char_class[c] |= C_DIGIT;
+    }
+}
+
+typedef struct {
+    const char *filename;
+    const char *p;
+    const char *end;
+    const char *line;
+    int row;
+    /* columns before line, when input starts part way into a line */
+    int col;
+} reader_t;
+
+static void reader_newline(reader_t *r, const char *nl) {
+    r->row++;
+    r->line = nl + 1;
+    r->col = 0;
+}
+
+static void skip_space(reader_t *r) {
+    while (r->p < r->end && (char_class[(unsigned char)*r->p] & C_SPACE)) {
+        if (*r->p == '\n') {
+            reader_newline(r, r->p);
+        }
+        r->p++;
+    }
+}
+
+/* describe the character at p the way mpc_err_char_unescape does */
+static void describe(reader_t *r, char *buf, size_t n) {
+    if (r->p >= r->end) {
+        snprintf(buf, n, "end of input");
+        return;
+    }
+    switch (*r->p) {
+        case '\a': snprintf(buf, n, "bell"); break;
+        case '\b': snprintf(buf, n, "backspace"); break;
+        case '\f': snprintf(buf, n, "formfeed"); break;
+        case '\r': snprintf(buf, n, "carriage return"); break;
+        case '\v': snprintf(buf, n, "vertical tab"); break;
+        case '\0': snprintf(buf, n, "end of input"); break;
+        case '\n': snprintf(buf, n, "newline"); break;
+        case '\t': snprintf(buf, n, "tab"); break;
+        case ' ':  snprintf(buf, n, "space"); break;
+        default:   snprintf(buf, n, "'%c'", *r->p); break;
+    }
+}
+
+static lval* read_error(reader_t *r, const char *expected) {
+    char at[32];
+    char msg[512];
+    describe(r, at, sizeof(at));
+    snprintf(msg, sizeof(msg), "%s:%i:%i: error: expected %s at %s\n",
+             r->filename, r->row + 1, r->col + (int)(r->p - r->line) + 1, expected, at);
+    return lval_err(msg);
+}
+
+/*
+ * -?[0-9]+ or the decimal -?[0-9]+\.[0-9]+. A '.' without digits after
+ * it is a syntax error, set in *err, since mpc tries decimals first and
+ * reports how far that got.
+ */
+static lval* read_number(reader_t *r, lval **err) {
+    const char *start = r->p;
+    if (*r->p == '-') {
+        r->p++;
+    }
+    while (r->p < r->end && (char_class[(unsigned char)*r->p] & C_DIGIT)) {
+        r->p++;
+    }
+
+    if (r->p < r->end && *r->p == '.') {
+        r->p++;
+        if (r->p >= r->end || !(char_class[(unsigned char)*r->p] & C_DIGIT)) {
+            *err = read_error(r, "one or more of one of '0123456789'");
+            return NULL;
+        }
+        while (r->p < r->end && (char_class[(unsigned char)*r->p] & C_DIGIT)) {
+            r->p++;
+        }
+        return lval_dbl(lnum_double(start, (size_t)(r->p - start)));
+    }
+
+    long x;
+    if (!lnum_long(start, (size_t)(r->p - start), &x)) {
+        return lval_err("invalid number");
+    }
+    return lval_num(x);
+}
+
+/* the escapes understood by mpcf_unescape */
+static char unescape(char c, int *known) {
+    *known = 1;
+    switch (c) {
+        case 'a':  return '\a';
+        case 'b':  return '\b';
+        case 'f':  return '\f';
+        case 'n':  return '\n';
+        case 'r':  return '\r';
+        case 't':  return '\t';
+        case 'v':  return '\v';
+        case '\\': return '\\';
+        case '\'': return '\'';
+        case '"':  return '"';
+        case '0':  return '\0';
+    }
+    *known = 0;
+    return c;
+}
+
+/* "(\\.|[^"])*" */
+static lval* read_string(reader_t *r) {
+    const char *start = ++r->p;
+    int escapes = 0;
+
+    while (r->p < r->end && *r->p != '"') {
+        if (*r->p == '\\' && r->p + 1 < r->end) {
+            escapes = 1;
+            r->p++;
+        }
+        if (*r->p == '\n') {
+            reader_newline(r, r->p);
+        }
+        r->p++;
+    }
+    if (r->p >= r->end) {
+        return read_error(r, "'\"'");
+    }
+
+    size_t len = (size_t)(r->p - start);
+    r->p++;
+    if (!escapes) {
+        return lval_str(lstr_new(start, len));
+    }
+
+    char *buf = malloc(len);
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        int known = 0;
+        char c = start[i] == '\\' ? unescape(start[i + 1], &known) : start[i];
+        if (known) {
+            i++;
+        }
+        buf[n++] = c;
+    }
+    lval *x = lval_str(lstr_new(buf, n));
+    free(buf);
+    return x;
+}
+
+static lval* read_symbol(reader_t *r) {
+    const char *start = r->p;
+    while (r->p < r->end && (char_class[(unsigned char)*r->p] & C_SYMBOL)) {
+        r->p++;
+    }
+    return lval_sym_n(start, (size_t)(r->p - start));
+}
+
+static void reader_init(void) {
+    static int ready = 0;
+    if (!ready) {
+        char_class_init();
+        ready = 1;
+    }
+}
+
+static lval* read_all(reader_t *r) {
+    lval *fixed[READER_STACK];
+    lval **stack = fixed;
+    int cap = READER_STACK;
+    int depth = 0;
+    lval *err = NULL;
+
+    stack[depth++] = lval_sexpr();
+
+    while (err == NULL) {
+        skip_space(r);
+
+        if (r->p >= r->end) {
+            if (depth > 1) {
+                err = read_error(r, "')'");
+            }
+            break;
+        }
+
+        char c = *r->p;
+        lval *x = NULL;
+
+        if (char_class[(unsigned char)c] & C_DIGIT
+            || (c == '-' && r->p + 1 < r->end && (char_class[(unsigned char)r->p[1]] & C_DIGIT))) {
+            x = read_number(r, &err);
+            if (err) {
+                break;
+            }
+        } else if (c == '"') {
+            x = read_string(r);
+            if (x->type == LVAL_ERR) {
+                err = x;
+                break;
+            }
+        } else if (char_class[(unsigned char)c] & C_SYMBOL) {
+            x = read_symbol(r);
+        } else if (c == '(') {
+            if (depth == LvalMaxDepth) {
+                err = read_error(r, "fewer nested lists");
+                break;
+            }
+            r->p++;
+            if (depth == cap) {
+                cap *= 2;
+                if (stack == fixed) {
+                    stack = malloc(sizeof(lval*) * cap);
+                    memcpy(stack, fixed, sizeof(fixed));
+                } else {
+                    stack = realloc(stack, sizeof(lval*) * cap);
+                }
+            }
+            stack[depth++] = lval_sexpr();
+            continue;
+        } else if (c == ')' && depth > 1) {
+            r->p++;
+            x = stack[--depth];
+        } else {
+            err = read_error(r, depth > 1 ? "expression or ')'" : "expression or end of input");
+            break;
+        }
+
+        lval_add(stack[depth - 1], x);
+    }
+
+    if (err) {
+        /* closing the open lists frees everything read so far */
+        while (depth > 1) {
+            lval *x = stack[--depth];
+            lval_add(stack[depth - 1], x);
+        }
+        lval_del(stack[0]);
+    }
+    lval *root = err ? err : stack[0];
+    if (stack != fixed) {
+        free(stack);
+    }
+    return root;
+}
+
+lval* lval_read_buffer(const char *filename, const char *input, size_t len) {
+    reader_init();
+
+    reader_t r;
+    r.filename = filename;
+    r.p = input;
+    r.end = input + len;
+    r.line = input;
+    r.row = 0;
+    r.col = 0;
+    return read_all(&r);
+}
+
+/*
+ * Parallel reading
+ *
+ * A serial pre-scan cuts the input into chunks at whitespace outside any
+ * list or string, noting the row and column each chunk starts at. Every
+ * chunk then reads to the same lvals it would have as part of the whole,
+ * so worker threads can read them independently and the results are
+ * joined back together in order.
+ */
+
+/* inputs smaller than this are not worth splitting */
+#define PARALLEL_CHUNK_MIN  (256 * 1024)
+/* chunks per thread, so a slow chunk doesn't hold up the rest */
+#define PARALLEL_SPLIT      4
+
+typedef struct {
+    reader_t r;
+    lval *result;
+} chunk_t;
+
+typedef struct {
+    chunk_t *chunks;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} chunk_queue_t;
+
+static int split_chunks(const char *filename, const char *input, size_t len,
+                        chunk_t *chunks, int max) {
+    size_t target = len / max > PARALLEL_CHUNK_MIN ? len / max : PARALLEL_CHUNK_MIN;
+    size_t start = 0;
+    int row = 0, col = 0;
+    int start_row = 0, start_col = 0;
+    int depth = 0, in_string = 0;
+    int count = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        char c = input[i];
+        if (in_string) {
+            if (c == '\\' && i + 1 < len) {
+                /* the escaped character can't end the string */
+                c = input[++i];
+                col++;
+            } else if (c == '"') {
+                in_string = 0;
+            }
+        } else if (c == '"') {
+            in_string = 1;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth -= depth > 0;
+        } else if (depth == 0 && (char_class[(unsigned char)c] & C_SPACE)
+                   && i - start >= target && count < max - 1) {
+            chunk_t *k = &chunks[count++];
+            k->r.p = input + start;
+            k->r.end = input + i;
+            k->r.row = start_row;
+            k->r.col = start_col;
+            start = i;
+            start_row = row;
+            start_col = col;
+        }
+
+        if (c == '\n') {
+            row++;
+            col = 0;
+        } else {
+            col++;
+        }
+    }
+
+    chunk_t *k = &chunks[count++];
+    k->r.p = input + start;
+    k->r.end = input + len;
+    k->r.row = start_row;
+    k->r.col = start_col;
+
+    for (int i = 0; i < count; ++i) {
+        chunks[i].r.filename = filename;
+        chunks[i].r.line = chunks[i].r.p;
+        chunks[i].result = NULL;
+    }
+    return count;
+}
+
+static void* read_worker(void *arg) {
+    chunk_queue_t *q = arg;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        int i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        if (i >= q->count) {
+            return NULL;
+        }
+        q->chunks[i].result = read_all(&q->chunks[i].r);
+    }
+}
+
+lval* lval_read_parallel(const char *filename, const char *input, size_t len, int threads) {
+    if (threads <= 1 || len < 2 * PARALLEL_CHUNK_MIN) {
+        return lval_read_buffer(filename, input, len);
+    }
+    reader_init();
+
+    chunk_queue_t q;
+    q.chunks = malloc(sizeof(chunk_t) * threads * PARALLEL_SPLIT);
+    q.count = split_chunks(filename, input, len, q.chunks, threads * PARALLEL_SPLIT);
+    q.next = 0;
+    pthread_mutex_init(&q.lock, NULL);
+
+    pthread_t *pool = malloc(sizeof(pthread_t) * threads);
+    int started = 0;
+    for (int i = 0; i < threads && i < q.count; ++i) {
+        if (pthread_create(&pool[started], NULL, read_worker, &q) == 0) {
+            started++;
+        }
+    }
+    /* whatever no thread could be started for is read here */
+    read_worker(&q);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(pool[i], NULL);
+    }
+    free(pool);
+    pthread_mutex_destroy(&q.lock);
+
+    /* a serial read stops at the first error, so that is the one to report */
+    lval *root = NULL;
+    int total = 0;
+    for (int i = 0; i < q.count; ++i) {
+        lval *x = q.chunks[i].result;
+        if (root == NULL && x->type == LVAL_ERR) {
+            root = x;
+            q.chunks[i].result = NULL;
+        }
+        total += x->type == LVAL_SEXPR ? x->count : 0;
+    }
+
+    if (root == NULL) {
+        root = lval_sexpr();
+        root->cell = malloc(sizeof(lval*) * total);
+        for (int i = 0; i < q.count; ++i) {
+            lval *x = q.chunks[i].result;
+            memcpy(root->cell + root->count, x->cell, sizeof(lval*) * x->count);
+            root->count += x->count;
+            x->count = 0;
+        }
+    }
+    for (int i = 0; i < q.count; ++i) {
+        if (q.chunks[i].result) {
+            lval_del(q.chunks[i].result);
+        }
+    }
+    free(q.chunks);
+    return root;
+}
+
+/*
+ * Streaming
+ *
+ * The stream only ever holds the top-level form it is reading. It scans
+ * ahead for the end of that form, tracking brackets and strings but
+ * nothing else, then hands exactly those bytes to read_all. Everything
+ * in front of the form is discarded before the buffer is refilled, so
+ * the buffer only grows to fit the largest single form in the input.
+ */
+
+#define STREAM_CHUNK    65536
+
+struct lval_stream {
+    const char *filename;
+    FILE *fp;
+    int eof;
+    int error;
+
+    char *buf;
+    size_t cap;
+    size_t start;       /* first byte of the form being scanned */
+    size_t pos;         /* next byte to scan */
+    size_t end;         /* end of the bytes read so far */
+
+    /* scanner state at pos */
+    int depth;
+    int in_string;
+    int escape;
+    int row;
+    int col;
+    /* position of start in the file */
+    int start_row;
+    int start_col;
+
+    /* forms read from the last chunk and not yet returned */
+    lval *pending;
+};
+
+lval_stream* lval_stream_new(const char *filename, FILE *fp) {
+    reader_init();
+
+    lval_stream *s = calloc(1, sizeof(lval_stream));
+    s->filename = filename;
+    s->fp = fp;
+    s->cap = STREAM_CHUNK;
+    s->buf = malloc(s->cap);
+    return s;
+}
+
+void lval_stream_delete(lval_stream *s) {
+    if (s->pending) {
+        lval_del(s->pending);
+    }
+    free(s->buf);
+    free(s);
+}
+
+/* read more input, keeping the bytes from start onwards */
+static int stream_fill(lval_stream *s) {
+    if (s->eof) {
+        return 0;
+    }
+    if (s->start > 0) {
+        memmove(s->buf, s->buf + s->start, s->end - s->start);
+        s->pos -= s->start;
+        s->end -= s->start;
+        s->start = 0;
+    }
+    if (s->end == s->cap) {
+        s->cap *= 2;
+        s->buf = realloc(s->buf, s->cap);
+    }
+    size_t n = fread(s->buf + s->end, 1, s->cap - s->end, s->fp);
+    if (n == 0) {
+        s->eof = 1;
+    }
+    s->end += n;
+    return n > 0;
+}
+
+/*
+ * Advance pos to the end of the next top-level form. Returns 0 if the
+ * input ran out first, leaving the scanner state to resume from.
+ */
+static int stream_scan(lval_stream *s) {
+    while (s->pos < s->end) {
+        char c = s->buf[s->pos];
+        int cls = char_class[(unsigned char)c];
+        int done = 0;
+        int skipped = 0;
+
+        if (s->in_string) {
+            if (s->escape) {
+                s->escape = 0;
+            } else if (c == '\\') {
+                s->escape = 1;
+            } else if (c == '"') {
+                s->in_string = 0;
+                done = s->depth == 0;
+            }
+        } else if (s->depth == 0 && (cls & C_SPACE)) {
+            if (s->pos > s->start) {
+                return 1;
+            }
+            /* leading space is dropped rather than kept in the buffer */
+            skipped = 1;
+        } else if (c == '"') {
+            s->in_string = 1;
+        } else if (c == '(') {
+            s->depth++;
+        } else if (c == ')') {
+            done = s->depth <= 1;
+            s->depth -= s->depth > 0;
+        }
+
+        if (c == '\n') {
+            s->row++;
+            s->col = 0;
+        } else {
+            s->col++;
+        }
+        s->pos++;
+        if (skipped) {
+            s->start = s->pos;
+            s->start_row = s->row;
+            s->start_col = s->col;
+        }
+
+        if (done) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int lval_stream_error(lval_stream *s) {
+    return s->error;
+}
+
+lval* lval_stream_read(lval_stream *s) {
+    s->error = 0;
+    while (s->pending == NULL || s->pending->count == 0) {
+        if (s->pending) {
+            lval_del(s->pending);
+            s->pending = NULL;
+        }
+
+        while (!stream_scan(s)) {
+            if (!stream_fill(s)) {
+                break;
+            }
+        }
+        if (s->pos == s->start) {
+            return NULL;
+        }
+
+        reader_t r;
+        r.filename = s->filename;
+        r.p = s->buf + s->start;
+        r.end = s->buf + s->pos;
+        r.line = r.p;
+        r.row = s->start_row;
+        r.col = s->start_col;
+
+        lval *x = read_all(&r);
+        s->start = s->pos;
+        s->depth = 0;
+        s->in_string = 0;
+        s->escape = 0;
+        s->start_row = s->row;
+        s->start_col = s->col;
+        if (x->type == LVAL_ERR) {
+            s->error = 1;
+            return x;
+        }
+        s->pending = x;
+    }
+    return lval_pop(s->pending, 0);
+}
+
+/*
+ * Splitting a buffer into forms
+ *
+ * The same scan the stream does, run over a buffer already in memory, so
+ * each form can be read on its own and the rest left alone.
+ */
+
+size_t lval_split_forms(const char *input, size_t len, lval_form **forms) {
+    reader_init();
+
+    lval_stream s;
+    memset(&s, 0, sizeof(s));
+    s.buf = (char*)input;
+    s.end = len;
+    s.eof = 1;
+
+    size_t n = 0;
+    size_t cap = 64;
+    lval_form *f = malloc(sizeof(lval_form) * cap);
+    for (;;) {
+        stream_scan(&s);
+        if (s.pos == s.start) {
+            break;
+        }
+        if (n == cap) {
+            cap *= 2;
+            f = realloc(f, sizeof(lval_form) * cap);
+        }
+        f[n].start = s.start;
+        f[n].len = s.pos - s.start;
+        f[n].row = s.start_row;
+        f[n].col = s.start_col;
+        n++;
+
+        s.start = s.pos;
+        s.depth = 0;
+        s.in_string = 0;
+        s.escape = 0;
+        s.start_row = s.row;
+        s.start_col = s.col;
+    }
+    *forms = f;
+    return n;
+}
+
+lval* lval_read_form(const char *filename, const char *input, lval_form f) {
+    reader_init();
+
+    reader_t r;
+    r.filename = filename;
+    r.p = input + f.start;
+    r.end = r.p + f.len;
+    r.line = r.p;
+    r.row = f.row;
+    r.col = f.col;
+    return read_all(&r);
+}
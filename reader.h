@@ -0,0 +1,87 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Hand written reader for the Lispy grammar, in mpca_lang notation:
+ *
+ *     number  : /-?[0-9]+/ ;
+ *     decimal : /-?[0-9]+\.[0-9]+/ ;
+ *     string  : /"(\\.|[^"])*"/ ;
+ *     sexpr   : '(' <expr>* ')' ;
+ *     symbol  : /[a-zA-Z0-9_+\-*\/\\=<>!&%]+/ ;
+ *     expr    : <decimal> | <number> | <string> | <symbol> | <sexpr> ;
+ *     lispy   : /^/ <expr>* /$/ ;
+ *
+ * Whitespace is allowed around every token. The input buffer is scanned
+ * once and lvals are built as it goes, without an mpc_ast_t in between.
+ * Compiling with -DMPC_READER reads the same grammar through mpc
+ * instead, see LvalLispy in lispy.c.
+ *
+ * Requires mpc.h, rrb.h, hamt.h, lstr.h and lispy.h to be included first.
+ */
+
+#ifndef READER_H
+#define READER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Read every expression in input into an S-expression, the way the
+ * `lispy` rule would. On a syntax error the result is instead an
+ * LVAL_ERR holding a message formatted like mpc_err_string, complete
+ * with file name, row and column. The row and column are where mpc would
+ * fail too, but what it says was expected is shorter than mpc's list.
+ */
+lval* lval_read_buffer(const char *filename, const char *input, size_t len);
+
+/*
+ * Same result as lval_read_buffer, but large inputs are split between top
+ * level forms and read on up to `threads` threads.
+ */
+lval* lval_read_parallel(const char *filename, const char *input, size_t len, int threads);
+
+/*
+ * Reads top-level expressions from a file or pipe one at a time, so each
+ * can be evaluated and freed before the next is read. Memory use is
+ * bounded by the largest single expression, not the size of the input.
+ */
+typedef struct lval_stream lval_stream;
+
+lval_stream* lval_stream_new(const char *filename, FILE *fp);
+void lval_stream_delete(lval_stream *s);
+
+/*
+ * The next expression in the stream, or NULL once it is exhausted. A
+ * syntax error is returned as an LVAL_ERR with its row and column in the
+ * whole input, and reading carries on with the expression after it.
+ */
+lval* lval_stream_read(lval_stream *s);
+
+/* nonzero if the last lval_stream_read returned a syntax error */
+int lval_stream_error(lval_stream *s);
+
+/*
+ * A top-level form in a buffer: the bytes the stream would hand to the
+ * reader in one go, and the row and column they start at.
+ */
+typedef struct {
+    size_t start;
+    size_t len;
+    int row;
+    int col;
+} lval_form;
+
+/*
+ * Find the top-level forms in input without reading them. Returns how many
+ * there are, with their extents in a malloc'd array stored to *forms.
+ */
+size_t lval_split_forms(const char *input, size_t len, lval_form **forms);
+
+/*
+ * Read just the form f of input, which gives an S-expression of what it
+ * holds, or an LVAL_ERR placed at its row and column in the whole input.
+ */
+lval* lval_read_form(const char *filename, const char *input, lval_form f);
+
+#endif /* READER_H */
@@ -0,0 +1,659 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Relaxed radix balanced tree, see rrb.h
+ *
+ * Leaves hold up to RRB_BRANCH elements and internal nodes hold up to
+ * RRB_BRANCH children. A node whose children (except the last) are all
+ * completely full is indexed by plain radix arithmetic. Any other node
+ * carries a table of cumulative child sizes which is searched instead.
+ * Nodes are reference counted and never modified once they are shared.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rrb.h"
+
+#define RRB_BITS    5
+#define RRB_BRANCH  (1 << RRB_BITS)
+#define RRB_MASK    (RRB_BRANCH - 1)
+
+/* how many more nodes than optimal a concatenation may leave behind */
+#define RRB_EXTRAS  2
+
+typedef struct rrb_node {
+    int refs;
+    int count;
+    size_t *sizes;
+    void *slots[RRB_BRANCH];
+} rrb_node;
+
+/*
+ * Nodes
+ */
+
+static rrb_node *node_new(void) {
+    rrb_node *n = malloc(sizeof(rrb_node));
+    n->refs = 1;
+    n->count = 0;
+    n->sizes = NULL;
+    return n;
+}
+
+/* drop a reference to n, passing each element it frees to f */
+static void node_release_each(rrb_node *n, int shift, rrb_each_t f, void *d) {
+    if (n == NULL || --n->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < n->count; ++i) {
+        if (shift == 0) {
+            f(n->slots[i], d);
+        } else {
+            node_release_each(n->slots[i], shift - RRB_BITS, f, d);
+        }
+    }
+    free(n->sizes);
+    free(n);
+}
+
+static void slot_release(void *x, void *d) {
+    ((rrb_t*)d)->release(x);
+}
+
+static void node_release(rrb_t *t, rrb_node *n, int shift) {
+    node_release_each(n, shift, slot_release, t);
+}
+
+/* take a new reference to a slot of a node at the given shift */
+static void *slot_retain(rrb_t *t, void *x, int shift) {
+    if (shift == 0) {
+        return t->retain(x);
+    }
+    ((rrb_node*)x)->refs++;
+    return x;
+}
+
+/* copy the first `count` slots of n into a fresh unshared node */
+static rrb_node *node_clone(rrb_t *t, rrb_node *n, int shift, int count) {
+    rrb_node *c = node_new();
+    c->count = count;
+    for (int i = 0; i < count; ++i) {
+        c->slots[i] = slot_retain(t, n->slots[i], shift);
+    }
+    if (n->sizes) {
+        c->sizes = malloc(sizeof(size_t) * RRB_BRANCH);
+        memcpy(c->sizes, n->sizes, sizeof(size_t) * count);
+    }
+    return c;
+}
+
+/* number of elements below a node */
+static size_t node_size(rrb_node *n, int shift) {
+    size_t total = 0;
+    while (shift > 0) {
+        if (n->sizes) {
+            return total + n->sizes[n->count - 1];
+        }
+        total += (size_t)(n->count - 1) << shift;
+        n = n->slots[n->count - 1];
+        shift -= RRB_BITS;
+    }
+    return total + n->count;
+}
+
+/*
+ * Recompute the size table of an internal node, dropping it when every
+ * child but the last is full so lookups can go back to radix indexing.
+ */
+static void node_fix_sizes(rrb_node *n, int shift) {
+    size_t full = (size_t)1 << shift;
+    size_t total = 0;
+    int regular = 1;
+
+    if (shift == 0) {
+        return;
+    }
+    if (n->sizes == NULL) {
+        n->sizes = malloc(sizeof(size_t) * RRB_BRANCH);
+    }
+    for (int i = 0; i < n->count; ++i) {
+        size_t s = node_size(n->slots[i], shift - RRB_BITS);
+        if (i < n->count - 1 && s != full) {
+            regular = 0;
+        }
+        total += s;
+        n->sizes[i] = total;
+    }
+    if (regular) {
+        free(n->sizes);
+        n->sizes = NULL;
+    }
+}
+
+/* find the child holding index *i, and make *i relative to that child */
+static int node_locate(rrb_node *n, int shift, size_t *i) {
+    int j;
+    if (n->sizes == NULL) {
+        j = (int)((*i >> shift) & RRB_MASK);
+        *i -= (size_t)j << shift;
+        return j;
+    }
+    j = (int)(*i >> shift);
+    while (n->sizes[j] <= *i) {
+        j++;
+    }
+    if (j > 0) {
+        *i -= n->sizes[j - 1];
+    }
+    return j;
+}
+
+/* a chain of single child nodes ending in a leaf holding x */
+static rrb_node *node_path(int shift, void *x) {
+    rrb_node *n = node_new();
+    n->count = 1;
+    n->slots[0] = x;
+    while (shift > 0) {
+        rrb_node *p = node_new();
+        p->count = 1;
+        p->slots[0] = n;
+        n = p;
+        shift -= RRB_BITS;
+    }
+    return n;
+}
+
+static rrb_t *rrb_wrap(rrb_t *t, rrb_node *root, int shift, size_t count) {
+    rrb_t *r = malloc(sizeof(rrb_t));
+    r->count = count;
+    r->shift = shift;
+    r->root = root;
+    r->retain = t->retain;
+    r->release = t->release;
+
+    /* collapse single child roots left behind by pop and slice */
+    while (r->root && r->shift > 0 && r->root->count == 1) {
+        rrb_node *child = r->root->slots[0];
+        child->refs++;
+        node_release(r, r->root, r->shift);
+        r->root = child;
+        r->shift -= RRB_BITS;
+    }
+    return r;
+}
+
+/*
+ * Construction
+ */
+
+rrb_t *rrb_new(rrb_retain_t retain, rrb_release_t release) {
+    rrb_t *t = malloc(sizeof(rrb_t));
+    t->count = 0;
+    t->shift = 0;
+    t->root = NULL;
+    t->retain = retain;
+    t->release = release;
+    return t;
+}
+
+rrb_t *rrb_copy(rrb_t *t) {
+    if (t->root) {
+        t->root->refs++;
+    }
+    return rrb_wrap(t, t->root, t->shift, t->count);
+}
+
+void rrb_delete(rrb_t *t) {
+    node_release(t, t->root, t->shift);
+    free(t);
+}
+
+void rrb_delete_each(rrb_t *t, rrb_each_t f, void *d) {
+    node_release_each(t->root, t->shift, f, d);
+    free(t);
+}
+
+/*
+ * Lookup
+ */
+
+size_t rrb_count(rrb_t *t) {
+    return t->count;
+}
+
+void *rrb_nth(rrb_t *t, size_t i) {
+    rrb_node *n = t->root;
+    int shift = t->shift;
+    while (shift > 0) {
+        n = n->slots[node_locate(n, shift, &i)];
+        shift -= RRB_BITS;
+    }
+    return n->slots[i];
+}
+
+/*
+ * The leaf slots starting at index i, and how many elements can be read
+ * from there before the next leaf. Used for fast sequential iteration.
+ */
+void **rrb_chunk(rrb_t *t, size_t i, size_t *len) {
+    rrb_node *n = t->root;
+    int shift = t->shift;
+    while (shift > 0) {
+        n = n->slots[node_locate(n, shift, &i)];
+        shift -= RRB_BITS;
+    }
+    *len = n->count - i;
+    return &n->slots[i];
+}
+
+/*
+ * Update
+ */
+
+static rrb_node *node_update(rrb_t *t, rrb_node *n, int shift, size_t i, void *x) {
+    rrb_node *c = node_clone(t, n, shift, n->count);
+    if (shift == 0) {
+        t->release(c->slots[i]);
+        c->slots[i] = x;
+        return c;
+    }
+    int j = node_locate(n, shift, &i);
+    node_release(t, c->slots[j], shift - RRB_BITS);
+    c->slots[j] = node_update(t, n->slots[j], shift - RRB_BITS, i, x);
+    return c;
+}
+
+rrb_t *rrb_update(rrb_t *t, size_t i, void *x) {
+    return rrb_wrap(t, node_update(t, t->root, t->shift, i, x), t->shift, t->count);
+}
+
+/*
+ * Push
+ */
+
+/* append along the rightmost path, or NULL if that path has no room */
+static rrb_node *node_push(rrb_t *t, rrb_node *n, int shift, void *x) {
+    rrb_node *c;
+    rrb_node *child;
+
+    if (shift == 0) {
+        if (n->count == RRB_BRANCH) {
+            return NULL;
+        }
+        c = node_clone(t, n, shift, n->count);
+        c->slots[c->count++] = x;
+        return c;
+    }
+
+    child = node_push(t, n->slots[n->count - 1], shift - RRB_BITS, x);
+    if (child) {
+        c = node_clone(t, n, shift, n->count);
+        node_release(t, c->slots[c->count - 1], shift - RRB_BITS);
+        c->slots[c->count - 1] = child;
+        if (c->sizes) {
+            c->sizes[c->count - 1]++;
+        }
+        return c;
+    }
+
+    if (n->count == RRB_BRANCH) {
+        return NULL;
+    }
+    c = node_clone(t, n, shift, n->count);
+    c->slots[c->count++] = node_path(shift - RRB_BITS, x);
+    if (c->sizes) {
+        c->sizes[c->count - 1] = c->sizes[c->count - 2] + 1;
+    } else if (node_size(n->slots[n->count - 1], shift - RRB_BITS) != (size_t)1 << shift) {
+        node_fix_sizes(c, shift);
+    }
+    return c;
+}
+
+rrb_t *rrb_push(rrb_t *t, void *x) {
+    rrb_node *root;
+
+    if (t->root == NULL) {
+        return rrb_wrap(t, node_path(0, x), 0, 1);
+    }
+
+    root = node_push(t, t->root, t->shift, x);
+    if (root) {
+        return rrb_wrap(t, root, t->shift, t->count + 1);
+    }
+
+    /* the tree is full along its right edge so grow a new root */
+    root = node_new();
+    root->count = 2;
+    root->slots[0] = t->root;
+    root->slots[1] = node_path(t->shift, x);
+    t->root->refs++;
+    node_fix_sizes(root, t->shift + RRB_BITS);
+    return rrb_wrap(t, root, t->shift + RRB_BITS, t->count + 1);
+}
+
+/*
+ * Pop
+ */
+
+/* drop the last element, or NULL if that leaves the node empty */
+static rrb_node *node_pop(rrb_t *t, rrb_node *n, int shift) {
+    rrb_node *c;
+    rrb_node *child;
+
+    if (shift == 0) {
+        return n->count == 1 ? NULL : node_clone(t, n, shift, n->count - 1);
+    }
+
+    child = node_pop(t, n->slots[n->count - 1], shift - RRB_BITS);
+    if (child == NULL) {
+        return n->count == 1 ? NULL : node_clone(t, n, shift, n->count - 1);
+    }
+    c = node_clone(t, n, shift, n->count);
+    node_release(t, c->slots[c->count - 1], shift - RRB_BITS);
+    c->slots[c->count - 1] = child;
+    if (c->sizes) {
+        c->sizes[c->count - 1]--;
+    }
+    return c;
+}
+
+rrb_t *rrb_pop(rrb_t *t) {
+    if (t->count <= 1) {
+        return rrb_wrap(t, NULL, 0, 0);
+    }
+    return rrb_wrap(t, node_pop(t, t->root, t->shift), t->shift, t->count - 1);
+}
+
+/*
+ * Slicing
+ */
+
+/* keep the first n elements, 0 < n <= size */
+static rrb_node *node_take(rrb_t *t, rrb_node *n, int shift, size_t count) {
+    size_t i = count - 1;
+    rrb_node *c;
+    int j;
+
+    if (shift == 0) {
+        return node_clone(t, n, shift, (int)count);
+    }
+
+    j = node_locate(n, shift, &i);
+    c = node_clone(t, n, shift, j);
+    c->count = j + 1;
+    c->slots[j] = node_take(t, n->slots[j], shift - RRB_BITS, i + 1);
+    if (c->sizes) {
+        c->sizes[j] = count;
+    }
+    return c;
+}
+
+/* drop the first n elements, 0 <= n < size */
+static rrb_node *node_drop(rrb_t *t, rrb_node *n, int shift, size_t count) {
+    size_t i = count;
+    rrb_node *c = node_new();
+    int j;
+
+    if (shift == 0) {
+        c->count = n->count - (int)count;
+        for (int k = 0; k < c->count; ++k) {
+            c->slots[k] = t->retain(n->slots[count + k]);
+        }
+        return c;
+    }
+
+    j = node_locate(n, shift, &i);
+    c->count = n->count - j;
+    if (i == 0) {
+        c->slots[0] = slot_retain(t, n->slots[j], shift);
+    } else {
+        c->slots[0] = node_drop(t, n->slots[j], shift - RRB_BITS, i);
+    }
+    for (int k = 1; k < c->count; ++k) {
+        c->slots[k] = slot_retain(t, n->slots[j + k], shift);
+    }
+    node_fix_sizes(c, shift);
+    return c;
+}
+
+rrb_t *rrb_slice(rrb_t *t, size_t from, size_t to) {
+    rrb_node *taken;
+    rrb_node *root;
+
+    if (to > t->count) {
+        to = t->count;
+    }
+    if (from >= to) {
+        return rrb_wrap(t, NULL, 0, 0);
+    }
+    if (from == 0 && to == t->count) {
+        return rrb_copy(t);
+    }
+
+    taken = node_take(t, t->root, t->shift, to);
+    if (from == 0) {
+        return rrb_wrap(t, taken, t->shift, to);
+    }
+    root = node_drop(t, taken, t->shift, from);
+    node_release(t, taken, t->shift);
+    return rrb_wrap(t, root, t->shift, to - from);
+}
+
+/*
+ * Concatenation
+ *
+ * Follows the algorithm of Bagwell and Rompf: merge the right edge of the
+ * left tree with the left edge of the right tree level by level, and at
+ * each level redistribute the slots of the nodes meeting in the middle
+ * just enough to keep the height within RRB_EXTRAS of optimal.
+ */
+
+/* the leaves or nodes of one level, as they are being merged */
+typedef struct {
+    int count;
+    rrb_node *nodes[2 * RRB_BRANCH + 2];
+} rrb_level;
+
+static void level_add_children(rrb_t *t, rrb_level *l, rrb_node *n, int from, int to, int shift) {
+    for (int i = from; i < to; ++i) {
+        l->nodes[l->count++] = slot_retain(t, n->slots[i], shift);
+    }
+}
+
+/* decide how many slots each merged node gets, returning the node count */
+static int concat_plan(rrb_level *all, int *plan) {
+    int n = all->count;
+    int total = 0;
+    int optimal;
+    int i = 0;
+
+    for (int k = 0; k < n; ++k) {
+        plan[k] = all->nodes[k]->count;
+        total += plan[k];
+    }
+    optimal = (total + RRB_BRANCH - 1) / RRB_BRANCH;
+
+    while (n > optimal + RRB_EXTRAS) {
+        int remaining;
+
+        /* skip nodes that are already close enough to full */
+        while (plan[i] > RRB_BRANCH - 1) {
+            i++;
+        }
+
+        /* spread this node's slots over the nodes that follow it */
+        remaining = plan[i];
+        do {
+            int fill = remaining + plan[i + 1];
+            if (fill > RRB_BRANCH) {
+                fill = RRB_BRANCH;
+            }
+            remaining = remaining + plan[i + 1] - fill;
+            plan[i] = fill;
+            i++;
+        } while (remaining > 0);
+
+        for (int k = i; k < n - 1; ++k) {
+            plan[k] = plan[k + 1];
+        }
+        n--;
+        i--;
+    }
+    return n;
+}
+
+/* build the nodes of a level according to its plan, consuming `all` */
+static void concat_execute(rrb_t *t, rrb_level *all, int *plan, int n, int shift, rrb_level *out) {
+    int from = 0;
+    int offset = 0;
+
+    out->count = 0;
+    for (int k = 0; k < n; ++k) {
+        rrb_node *c;
+
+        /* nodes untouched by the plan are reused as they are */
+        if (offset == 0 && all->nodes[from]->count == plan[k]) {
+            all->nodes[from]->refs++;
+            out->nodes[out->count++] = all->nodes[from++];
+            continue;
+        }
+
+        c = node_new();
+        while (c->count < plan[k]) {
+            rrb_node *src = all->nodes[from];
+            int take = src->count - offset;
+            if (take > plan[k] - c->count) {
+                take = plan[k] - c->count;
+            }
+            for (int s = 0; s < take; ++s) {
+                c->slots[c->count++] = slot_retain(t, src->slots[offset + s], shift);
+            }
+            offset += take;
+            if (offset == src->count) {
+                from++;
+                offset = 0;
+            }
+        }
+        node_fix_sizes(c, shift);
+        out->nodes[out->count++] = c;
+    }
+
+    for (int k = 0; k < all->count; ++k) {
+        node_release(t, all->nodes[k], shift);
+    }
+}
+
+/* group a rebalanced level into one or two parents, see concat_sub */
+static rrb_node *concat_wrap(rrb_level *level, int shift, int top, int *out_shift) {
+    rrb_node *parents[2];
+    int n = 0;
+
+    for (int k = 0; k < level->count; k += RRB_BRANCH) {
+        rrb_node *p = node_new();
+        for (int s = k; s < level->count && s < k + RRB_BRANCH; ++s) {
+            p->slots[p->count++] = level->nodes[s];
+        }
+        node_fix_sizes(p, shift);
+        parents[n++] = p;
+    }
+
+    if (top && n == 1) {
+        *out_shift = shift;
+        return parents[0];
+    }
+
+    rrb_node *root = node_new();
+    for (int k = 0; k < n; ++k) {
+        root->slots[root->count++] = parents[k];
+    }
+    node_fix_sizes(root, shift + RRB_BITS);
+    *out_shift = shift + RRB_BITS;
+    return root;
+}
+
+/*
+ * Merge l and r (either may be NULL) around the freshly built center c,
+ * all three at `shift`. The result is one level higher and holds one or
+ * two children, unless this is the top level and one child is enough.
+ */
+static rrb_node *concat_rebalance(rrb_t *t, rrb_node *l, rrb_node *c, rrb_node *r,
+                                  int shift, int top, int *out_shift) {
+    rrb_level all;
+    rrb_level merged;
+    int plan[2 * RRB_BRANCH + 2];
+    int n;
+
+    all.count = 0;
+    if (l) {
+        level_add_children(t, &all, l, 0, l->count - 1, shift);
+    }
+    level_add_children(t, &all, c, 0, c->count, shift);
+    if (r) {
+        level_add_children(t, &all, r, 1, r->count, shift);
+    }
+    node_release(t, c, shift);
+
+    n = concat_plan(&all, plan);
+    concat_execute(t, &all, plan, n, shift - RRB_BITS, &merged);
+    return concat_wrap(&merged, shift, top, out_shift);
+}
+
+static rrb_node *concat_sub(rrb_t *t, rrb_node *l, int lshift, rrb_node *r, int rshift,
+                            int top, int *out_shift) {
+    rrb_node *c;
+    int cshift;
+
+    if (lshift > rshift) {
+        c = concat_sub(t, l->slots[l->count - 1], lshift - RRB_BITS, r, rshift, 0, &cshift);
+        return concat_rebalance(t, l, c, NULL, lshift, top, out_shift);
+    }
+
+    if (lshift < rshift) {
+        c = concat_sub(t, l, lshift, r->slots[0], rshift - RRB_BITS, 0, &cshift);
+        return concat_rebalance(t, NULL, c, r, rshift, top, out_shift);
+    }
+
+    if (lshift == 0) {
+        rrb_node *p = node_new();
+        if (l->count + r->count <= RRB_BRANCH) {
+            rrb_node *leaf = node_clone(t, l, 0, l->count);
+            for (int k = 0; k < r->count; ++k) {
+                leaf->slots[leaf->count++] = t->retain(r->slots[k]);
+            }
+            if (top) {
+                free(p);
+                *out_shift = 0;
+                return leaf;
+            }
+            p->slots[p->count++] = leaf;
+        } else {
+            l->refs++;
+            r->refs++;
+            p->slots[p->count++] = l;
+            p->slots[p->count++] = r;
+        }
+        node_fix_sizes(p, RRB_BITS);
+        *out_shift = RRB_BITS;
+        return p;
+    }
+
+    c = concat_sub(t, l->slots[l->count - 1], lshift - RRB_BITS,
+                   r->slots[0], rshift - RRB_BITS, 0, &cshift);
+    return concat_rebalance(t, l, c, r, lshift, top, out_shift);
+}
+
+rrb_t *rrb_concat(rrb_t *a, rrb_t *b) {
+    rrb_node *root;
+    int shift;
+
+    if (a->count == 0) {
+        return rrb_copy(b);
+    }
+    if (b->count == 0) {
+        return rrb_copy(a);
+    }
+    root = concat_sub(a, a->root, a->shift, b->root, b->shift, 1, &shift);
+    return rrb_wrap(a, root, shift, a->count + b->count);
+}
@@ -0,0 +1,56 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Persistent vector backed by a relaxed radix balanced (RRB) tree.
+ *
+ * Every operation returns a new vector and leaves its inputs untouched.
+ * Unchanged parts of the tree are shared between versions, so indexing,
+ * update, push, pop, slicing and concatenation are all O(log32 n).
+ *
+ * Elements are opaque pointers. The vector takes ownership of elements
+ * passed to it, and calls `retain` whenever an element becomes shared by
+ * a second leaf and `release` when a leaf holding it is freed.
+ */
+
+#ifndef RRB_H
+#define RRB_H
+
+#include <stddef.h>
+
+typedef void *(*rrb_retain_t)(void *x);
+typedef void (*rrb_release_t)(void *x);
+typedef void (*rrb_each_t)(void *x, void *d);
+
+struct rrb_node;
+
+typedef struct rrb_t {
+    size_t count;
+    int shift;
+    struct rrb_node *root;
+    rrb_retain_t retain;
+    rrb_release_t release;
+} rrb_t;
+
+rrb_t *rrb_new(rrb_retain_t retain, rrb_release_t release);
+rrb_t *rrb_copy(rrb_t *t);
+void rrb_delete(rrb_t *t);
+
+/*
+ * Delete t, handing each element it held the last leaf reference to to
+ * f instead of releasing it. Lets the caller release nested elements
+ * without recursing through `release`.
+ */
+void rrb_delete_each(rrb_t *t, rrb_each_t f, void *d);
+
+size_t rrb_count(rrb_t *t);
+void *rrb_nth(rrb_t *t, size_t i);
+void **rrb_chunk(rrb_t *t, size_t i, size_t *len);
+
+rrb_t *rrb_push(rrb_t *t, void *x);
+rrb_t *rrb_update(rrb_t *t, size_t i, void *x);
+rrb_t *rrb_pop(rrb_t *t);
+rrb_t *rrb_slice(rrb_t *t, size_t from, size_t to);
+rrb_t *rrb_concat(rrb_t *a, rrb_t *b);
+
+#endif /* RRB_H */
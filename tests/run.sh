@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# Programmer: Kyle Kloberdanz
+# License: GNU GPLv3 (see LICENSE.txt)
+#
+# Regression tests, see `make test`. Each check pipes a program read from
+# stdin into the lispy binary given as $1 (./lispy by default) and
+# compares what it prints after the banner.
+#
+
+LISPY=${1:-./lispy}
+TMP=${TMPDIR:-/tmp}/lispy-test.$$
+failed=0
+
+# check NAME EXPECTED [ARGS...], reading the program from "-" by default
+check() {
+    name=$1
+    want=$2
+    shift 2
+    [ $# -gt 0 ] || set -- -
+    cat > "$TMP"
+    got=$(cat "$TMP" | "$LISPY" "$@" 2>&1 | tail -n +3)
+    if [ "$got" = "$want" ]; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        echo "  expected: $want" | cut -c 1-200
+        echo "  got:      $got" | cut -c 1-200
+        failed=1
+    fi
+}
+
+# nest F N: N calls of F nested around 1
+nest() {
+    awk -v f="$1" -v n="$2" 'BEGIN {
+        for (i = 0; i < n; i++) printf "(%s ", f
+        printf "1"
+        for (i = 0; i < n; i++) printf ")"
+    }'
+}
+
+# brackets OPEN CLOSE N: what printing nest's result looks like
+brackets() {
+    awk -v o="$1" -v c="$2" -v n="$3" 'BEGIN {
+        for (i = 0; i < n; i++) printf "%s", o
+        printf "1"
+        for (i = 0; i < n; i++) printf "%s", c
+    }'
+}
+
+# collections nested deeper than the C stack allows
+DEEP=200000
+
+echo "(count $(nest vec $DEEP))" | check "deep vector count" 1
+nest vec $DEEP | check "deep vector print" "$(brackets [ ] $DEEP)"
+echo "(get (hash-map $(nest vec $DEEP) 5) $(nest vec $DEEP))" |
+    check "deep vector as map key" 5
+echo "(count $(nest 'hash-map 1' $DEEP))" | check "deep map count" 1
+{ echo "(defrecord p a)"; echo "(get (hash-map $(nest p $DEEP) 7) $(nest p $DEEP))"; } |
+    check "deep record as map key" "()
+7"
+
+# a record is only reachable if no builtin has its name
+echo "(defrecord count a b)" | check "record named after a builtin" \
+    "Error: Function 'defrecord' passed the name of a builtin!"
+echo "(defrecord hash map)" | check "record accessor named after a builtin" \
+    "Error: Function 'defrecord' passed a field whose accessor is a builtin!"
+echo "(defrecord + a)" | check "record named after an operator" \
+    "Error: Function 'defrecord' passed the name of a builtin!"
+echo "(defrecord pt count) (pt-count (pt 3))" | check "record field named after a builtin" \
+    "()
+3"
+
+# the read cache budget can be set before start-up and changed at run time
+export LISPY_READ_CACHE_BUDGET=4096
+echo '(get (cache-stats) "budget") (cache-budget 0) (get (cache-stats) "budget")' |
+    check "read cache budget" "4096
+0
+0"
+unset LISPY_READ_CACHE_BUDGET
+
+# -j reads the whole input up front, which must work for pipes too
+echo "(+ 1 2) (vec 1)" | check "parallel read from a pipe" "3
+[1]" -j 4 /dev/stdin
+echo "(+ 1" | check "parallel read syntax error" \
+    "/dev/stdin:2:1: error: expected ')' at end of input" -j 4 /dev/stdin
+
+rm -f "$TMP"
+exit $failed
@@ -0,0 +1,276 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Watch mode, see watch.h
+ *
+ * Each refresh compares the new text with the last one to find the bytes
+ * that changed: everything before the first differing byte and after the
+ * last one is the same. Forms lying wholly in the unchanged prefix are at
+ * the same offsets as before, and forms in the unchanged suffix are just
+ * shifted, so both keep what they read to. Evaluation only reads Records,
+ * so a form's results can also be kept as long as RecordsVersion is what
+ * it was when they were computed.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "mpc.h"
+#include "rrb.h"
+#include "hamt.h"
+#include "lstr.h"
+#include "lispy.h"
+#include "reader.h"
+#include "watch.h"
+
+typedef struct {
+    lval_form form;
+    lval *read;             /* what the form read to, NULL on a syntax error */
+    lval *result;           /* what each of its expressions evaluated to */
+    unsigned long before;   /* RecordsVersion it was evaluated under */
+    unsigned long after;    /* RecordsVersion it left behind */
+    hamt_t *records;        /* Records it left behind */
+} watch_form;
+
+typedef struct {
+    const char *filename;
+    char *text;
+    size_t len;
+    watch_form *forms;
+    size_t count;
+} watch_state;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static char* read_file(const char *filename, size_t *len) {
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    size_t cap = 4096;
+    char *text = malloc(cap);
+    *len = 0;
+    size_t n;
+    while ((n = fread(text + *len, 1, cap - *len, fp)) > 0) {
+        *len += n;
+        if (*len == cap) {
+            cap *= 2;
+            text = realloc(text, cap);
+        }
+    }
+    fclose(fp);
+    return text;
+}
+
+static void forms_free(watch_form *forms, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (forms[i].read) {
+            lval_del(forms[i].read);
+        }
+        if (forms[i].result) {
+            lval_del(forms[i].result);
+        }
+        if (forms[i].records) {
+            hamt_delete(forms[i].records);
+        }
+    }
+    free(forms);
+}
+
+static void set_records(hamt_t *records, unsigned long version) {
+    if (Records) {
+        hamt_delete(Records);
+    }
+    Records = records ? hamt_copy(records) : NULL;
+    RecordsVersion = version;
+}
+
+/*
+ * The old form holding exactly the text of f, if f is outside the changed
+ * bytes. Forms come in order, so the search resumes from *j.
+ */
+static watch_form* find_old(watch_state *w, size_t *j, lval_form f,
+                            size_t prefix, size_t suffix, size_t len) {
+    size_t start;
+    if (f.start + f.len <= prefix) {
+        start = f.start;
+    } else if (f.start >= len - suffix) {
+        start = f.start + w->len - len;
+    } else {
+        return NULL;
+    }
+    while (*j < w->count && w->forms[*j].form.start < start) {
+        (*j)++;
+    }
+    if (*j < w->count && w->forms[*j].form.start == start && w->forms[*j].form.len == f.len) {
+        return &w->forms[*j];
+    }
+    return NULL;
+}
+
+static void refresh(watch_state *w, char *text, size_t len) {
+    double begin = now_ms();
+    double read_ms = 0;
+    double eval_ms = 0;
+    size_t nread = 0;
+    size_t neval = 0;
+
+    size_t shortest = len < w->len ? len : w->len;
+    size_t prefix = 0;
+    while (prefix < shortest && text[prefix] == w->text[prefix]) {
+        prefix++;
+    }
+    size_t suffix = 0;
+    while (suffix < shortest - prefix && text[len - suffix - 1] == w->text[w->len - suffix - 1]) {
+        suffix++;
+    }
+
+    lval_form *f;
+    size_t count = lval_split_forms(text, len, &f);
+    watch_form *forms = calloc(count ? count : 1, sizeof(watch_form));
+
+    /* replay the records from the top of the file */
+    set_records(NULL, 0);
+
+    size_t j = 0;
+    for (size_t i = 0; i < count; ++i) {
+        watch_form *old = find_old(w, &j, f[i], prefix, suffix, len);
+        watch_form *x = &forms[i];
+        x->form = f[i];
+
+        if (old && old->read) {
+            x->read = old->read;
+            old->read = NULL;
+        } else {
+            double t = now_ms();
+            lval *r = lval_read_form(w->filename, text, f[i]);
+            read_ms += now_ms() - t;
+            nread++;
+            if (r->type == LVAL_ERR) {
+                printf("%s", r->err);
+                lval_del(r);
+                x->before = x->after = RecordsVersion;
+                continue;
+            }
+            x->read = r;
+        }
+
+        x->before = RecordsVersion;
+        if (old && old->result && old->before == RecordsVersion) {
+            x->result = old->result;
+            x->records = old->records;
+            x->after = old->after;
+            old->result = NULL;
+            old->records = NULL;
+            set_records(x->records, x->after);
+            continue;
+        }
+
+        double t = now_ms();
+        x->result = lval_sexpr();
+        for (int k = 0; k < x->read->count; ++k) {
+            /* evaluation works on its input in place, so it gets a copy */
+            lval_add(x->result, lval_eval(lval_copy(x->read->cell[k])));
+        }
+        x->records = Records ? hamt_copy(Records) : NULL;
+        x->after = RecordsVersion;
+        eval_ms += now_ms() - t;
+        neval++;
+
+        for (int k = 0; k < x->result->count; ++k) {
+            printf("%s:%d: ", w->filename, f[i].row + 1);
+            lval_println(x->result->cell[k]);
+        }
+    }
+    free(f);
+
+    forms_free(w->forms, w->count);
+    free(w->text);
+    w->forms = forms;
+    w->count = count;
+    w->text = text;
+    w->len = len;
+
+    printf("lispy: %s bytes %zu-%zu changed, read %zu and evaluated %zu of %zu forms in %.3f ms"
+           " (read %.3f ms, eval %.3f ms)\n",
+           w->filename, prefix, len - suffix, nread, neval, count,
+           now_ms() - begin, read_ms, eval_ms);
+    fflush(stdout);
+}
+
+int watch_file(const char *filename) {
+    /* watch the directory, since editors often save by renaming over the file */
+    const char *slash = strrchr(filename, '/');
+    const char *base = slash ? slash + 1 : filename;
+    char *dir = slash ? strndup(filename, slash == filename ? 1 : (size_t)(slash - filename)) : strdup(".");
+
+    int fd = inotify_init();
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror(filename);
+        free(dir);
+        return 1;
+    }
+    free(dir);
+
+    watch_state w;
+    memset(&w, 0, sizeof(w));
+    w.filename = filename;
+    w.text = malloc(1);
+
+    printf("lispy: Watching file %s\n", filename);
+    size_t len;
+    char *text = read_file(filename, &len);
+    if (text == NULL) {
+        perror(filename);
+        return 1;
+    }
+    refresh(&w, text, len);
+
+    union {
+        struct inotify_event event;
+        char buf[4096];
+    } events;
+    for (;;) {
+        ssize_t n = read(fd, events.buf, sizeof(events.buf));
+        if (n <= 0) {
+            break;
+        }
+        int changed = 0;
+        for (char *p = events.buf; p < events.buf + n; ) {
+            struct inotify_event *e = (struct inotify_event*)p;
+            if (e->len > 0 && strcmp(e->name, base) == 0) {
+                changed = 1;
+            }
+            p += sizeof(struct inotify_event) + e->len;
+        }
+        if (!changed) {
+            continue;
+        }
+
+        text = read_file(filename, &len);
+        if (text == NULL) {
+            continue;
+        }
+        if (len == w.len && memcmp(text, w.text, len) == 0) {
+            free(text);
+            continue;
+        }
+        refresh(&w, text, len);
+    }
+
+    close(fd);
+    forms_free(w.forms, w.count);
+    free(w.text);
+    return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * Programmer: Kyle Kloberdanz
+ * License: GNU GPLv3 (see LICENSE.txt)
+ *
+ * Watch mode.
+ *
+ * Evaluates a file, then waits for it to be saved again and refreshes,
+ * printing the result of every form that was evaluated and how long the
+ * refresh took. Only the forms inside the bytes that changed are read
+ * again, and a form is only evaluated again when its text changed or a
+ * form before it changed the records it could see.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+/* runs until interrupted, returns nonzero if filename can't be watched */
+int watch_file(const char *filename);
+
+#endif /* WATCH_H */